@@ -27,8 +27,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
-#ifdef WINDOWS
-#include <conio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__AVX2__) || defined(__BMI2__)
+#include <immintrin.h>
+#endif
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #endif
 
 // Constants
@@ -39,12 +47,44 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define DEPTH_LIMIT 30
 #define INF         1048576
 #define STARTPOS    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0"
-#define HASH_KEY    ((1 << 22) - 1)
+#define HASH_MB     64
+#define HASH_MAX_MB 65536
+#define MAX_THREADS 128
+#define PACK(mg, eg) ((int64_t) (eg) * 0x100000000LL + (int64_t) (mg)) // MG/EG score pair
+#define EVAL_KEY    ((1 << 20) - 1)
+#define PAWN_KEY    ((1 << 16) - 1)
+#if defined(__BMI2__) && !defined(NO_PEXT)
+#define PEXT // Slider index with _pext_u64(). -DNO_PEXT where it is slow (AMD before Zen 3)
+#endif
+#define SLIDER_MOVES_N (5248 + 102400) // Sum of 2 ^ bits over bishop and rook masks
+#ifdef NO_STATS
+#define STAT(counter) ((void) 0)
+#else
+#define STAT(counter) (STATS.counter++) // -DNO_STATS compiles them out
+#endif
+#define BENCH_SEED  131783
+#define BENCH_DEPTH 8
+#define LAZY_CP     100 // LazyMargin default
+#define NNUE_INPUTS 768 // 2 colors x 6 pieces x 64 squares
+#define NNUE_HIDDEN 256
+#define NNUE_QA     255 // Accumulator clamp
+#define NNUE_QB     64  // Output weight scale
+#define NNUE_SCALE  400 // Output to cp
+#define NNUE_PLIES  128
+#define NNUE_MAGIC  "SAPNNUE1"
+#define NNUE_BYTES  (16 + 2 * (NNUE_INPUTS * NNUE_HIDDEN + NNUE_HIDDEN + 2 * NNUE_HIDDEN + 1))
+#define GEN_PLIES   400  // Longer self-play games are draws
+#define INPUT_LINES 16   // Initial queue size
+#define INPUT_SIZE  8192 // Chars per line
 
 // Enums
 
-enum MOVE_T {
-  KILLER, GOOD, QUIET
+enum BOUND_T {
+  UPPER = 1, LOWER = 2, EXACT = 3
+};
+
+enum PICK_T {
+  PICK_HASH, PICK_TACTICS_GEN, PICK_TACTICS, PICK_KILLERS, PICK_QUIETS_GEN, PICK_QUIETS, PICK_DONE
 };
 
 // Structures
@@ -52,28 +92,191 @@ enum MOVE_T {
 struct BOARD_T {
   uint64_t
     white[6],  // White bitboards
-    black[6];  // Black bitboards
+    black[6],  // Black bitboards
+    hash,      // Zobrist key (without side to move)
+    pawn_hash; // Zobrist key of pawns only
+  int64_t
+    score;     // Material + PSQT (Incremental, PACK)
   int8_t
     board[64], // Pieces black and white
     epsq;      // En passant square
-  int32_t
-    score;     // Sorting score
   uint8_t
-    index,     // Sorting index
-    from,      // From square
-    to,        // To square
-    type,      // Move type (0: Normal, 1: OOw, 2: OOOw, 3: OOb, 4: OOOb, 5: =n, 6: =b, 7: =r, 8: =q)
     castle,    // Castling rights (0x1: K, 0x2: Q, 0x4: k, 0x8: q)
     rule50;    // Rule 50 counter
 };
 
+struct MOVE_T {
+  int32_t
+    score;     // Sorting score
+  uint16_t
+    move;      // From (6 bits) | To (6 bits) | Type (4 bits, see Move())
+};
+
+struct UNDO_T {
+  uint64_t
+    hash,      // Zobrist key before the move
+    pawn_hash; // Pawn key before the move
+  int64_t
+    score;     // Material + PSQT before the move
+  int8_t
+    eat,       // Captured piece
+    epsq;      // En passant square before the move
+  uint8_t
+    castle,    // Castling rights before the move
+    rule50;    // Rule 50 counter before the move
+};
+
 struct HASH_T {
   uint64_t
-    eval_hash, sort_hash;
+    lock;        // Zobrist key ^ data (Lockless)
+  union {
+    struct {
+      int32_t
+        score;   // Search score
+      uint16_t
+        move;    // Best move
+      int8_t
+        depth;   // Search depth
+      uint8_t
+        flags;   // Bound (0x3) | Age (0xFC)
+    };
+    uint64_t
+      data;
+  };
+};
+
+struct EVAL_HASH_T {
+  uint64_t
+    lock;      // Zobrist key ^ score (Lockless)
   int32_t
     score;
+};
+
+struct PAWN_HASH_T {
+  uint64_t
+    lock;      // Pawn key ^ score (Lockless)
+  int64_t
+    score;     // Pawn structure (PACK)
+};
+
+struct NNUE_ACC_T {
+  _Alignas(32) int16_t
+    acc[2][NNUE_HIDDEN]; // First layer sums from white and black perspective
+  uint16_t
+    add[2][2],           // Features added by the move [n][perspective]
+    sub[2][2];           // Features removed by the move [n][perspective]
+  uint8_t
+    add_n, sub_n;
+  bool
+    computed;            // acc is up to date
+};
+
+struct SLIDER_T {
+  uint64_t
+    mask,      // Relevant occupancy (No edges)
+    magic,
+    *moves;    // Slice of SLIDER_MOVES (2 ^ bits in mask)
+  int
+    shift;     // 64 - bits in mask
+};
+
+struct STATS_T {
+  uint64_t
+    nodes,             // Interior nodes
+    qnodes,            // Quiescence nodes
+    cutoffs[8],        // Beta cutoffs by move index (Last: 8th and later)
+    lmr,               // Reduced searches
+    lmr_researches,    // Reduced searches that did not fail low
+    hash_probes,
+    hash_hits,
+    hash_moves,        // Hash hits with a move
+    hash_move_cutoffs, // Cutoffs by the hash move
+    eval_probes,
+    eval_hits,
+    pawn_probes,
+    pawn_hits,
+    lazy_probes,
+    lazy_hits;
+};
+
+struct PERFT_HASH_T {
+  uint64_t
+    lock,      // Key ^ nodes (Lockless)
+    nodes;
+};
+
+struct EPD_T {
+  char
+    fen[384],  // First 4 fields + rule50
+    bm[128],   // Best moves (SAN or coordinates)
+    am[128],   // Avoid moves
+    id[64];
+};
+
+struct EPD_RESULT_T {
+  uint64_t
+    nodes;
+  bool
+    solved;
+  char
+    report[768]; // Result line. Workers send the whole struct (Atomic pipe write)
+};
+
+struct SFEN_T { // 32 bytes per position. Little endian
+  uint64_t
+    occupied;    // Occupied squares
   uint8_t
-    killer, good, quiet;
+    pieces[16];  // 4 bits per occupied square from a1 up: 1..6 white PNBRQK, 9..14 black
+  int16_t
+    score;       // Search score (cp), side to move
+  uint16_t
+    move,        // Best move (See Move())
+    ply;         // Game ply
+  uint8_t
+    rule50,
+    flags;       // Bit 0: White to move, 1..4: Castling rights, 5..6: Result (0: Loss, 1: Draw, 2: Win), side to move
+};
+
+struct PERFT_T {
+  const char
+    *fen;
+  int
+    depth;
+  uint64_t
+    nodes;     // Expected count
+};
+
+struct PICKER_T {
+  struct MOVE_T
+    moves[MAX_MOVES]; // Generated moves (tactics first, then quiets)
+  uint16_t
+    hash_move,        // Best move from the hash
+    tried[3];         // Hash move and killers already yielded
+  int
+    stage,            // Current PICK_T stage
+    tried_n,          // Number of tried moves
+    moves_n,          // Number of generated moves
+    moves_i,          // Next generated move
+    ply;              // Ply for killers
+  bool
+    checks,           // Side to move is in check
+    tactical;         // Last yielded move is from the hash or tactical stage (No LMR)
+};
+
+struct THREAD_T {
+  pthread_t
+    thread;
+  struct BOARD_T
+    board;                     // Root position
+  struct MOVE_T
+    root_moves[MAX_MOVES];     // Sorted root moves
+  uint64_t
+    repetitions[128],          // Game history
+    seed;                      // Random seed (Eval noise)
+  _Atomic uint64_t
+    nodes;                     // Published by the thread (Relaxed). Stays valid after it exits
+  int
+    id, root_moves_n;
 };
 
 // Consts
@@ -112,15 +315,6 @@ static const uint64_t
      0x17e0101010100ULL,0x27c0202020200ULL,0x47a0404040400ULL,0x8760808080800ULL,0x106e1010101000ULL,0x205e2020202000ULL,0x403e4040404000ULL,0x807e8080808000ULL,
      0x7e010101010100ULL,0x7c020202020200ULL,0x7a040404040400ULL,0x76080808080800ULL,0x6e101010101000ULL,0x5e202020202000ULL,0x3e404040404000ULL,0x7e808080808000ULL,
      0x7e01010101010100ULL,0x7c02020202020200ULL,0x7a04040404040400ULL,0x7608080808080800ULL,0x6e10101010101000ULL,0x5e20202020202000ULL,0x3e40404040404000ULL,0x7e80808080808000ULL},
-  ROOK_MOVE_MAGICS[64] =
-    {0x101010101017eULL,0x202020202027cULL,0x404040404047aULL,0x8080808080876ULL,0x1010101010106eULL,0x2020202020205eULL,0x4040404040403eULL,0x8080808080807eULL,
-     0x1010101017e00ULL,0x2020202027c00ULL,0x4040404047a00ULL,0x8080808087600ULL,0x10101010106e00ULL,0x20202020205e00ULL,0x40404040403e00ULL,0x80808080807e00ULL,
-     0x10101017e0100ULL,0x20202027c0200ULL,0x40404047a0400ULL,0x8080808760800ULL,0x101010106e1000ULL,0x202020205e2000ULL,0x404040403e4000ULL,0x808080807e8000ULL,
-     0x101017e010100ULL,0x202027c020200ULL,0x404047a040400ULL,0x8080876080800ULL,0x1010106e101000ULL,0x2020205e202000ULL,0x4040403e404000ULL,0x8080807e808000ULL,
-     0x1017e01010100ULL,0x2027c02020200ULL,0x4047a04040400ULL,0x8087608080800ULL,0x10106e10101000ULL,0x20205e20202000ULL,0x40403e40404000ULL,0x80807e80808000ULL,
-     0x17e0101010100ULL,0x27c0202020200ULL,0x47a0404040400ULL,0x8760808080800ULL,0x106e1010101000ULL,0x205e2020202000ULL,0x403e4040404000ULL,0x807e8080808000ULL,
-     0x7e010101010100ULL,0x7c020202020200ULL,0x7a040404040400ULL,0x76080808080800ULL,0x6e101010101000ULL,0x5e202020202000ULL,0x3e404040404000ULL,0x7e808080808000ULL,
-     0x7e01010101010100ULL,0x7c02020202020200ULL,0x7a04040404040400ULL,0x7608080808080800ULL,0x6e10101010101000ULL,0x5e20202020202000ULL,0x3e40404040404000ULL,0x7e80808080808000ULL},
   BISHOP_MASK[64] =
     {0x40201008040200ULL,0x402010080400ULL,0x4020100a00ULL,0x40221400ULL,0x2442800ULL,0x204085000ULL,0x20408102000ULL,0x2040810204000ULL,
      0x20100804020000ULL,0x40201008040000ULL,0x4020100a0000ULL,0x4022140000ULL,0x244280000ULL,0x20408500000ULL,0x2040810200000ULL,0x4081020400000ULL,
@@ -130,65 +324,186 @@ static const uint64_t
      0x2000204081000ULL,0x4000408102000ULL,0xa000a10204000ULL,0x14001422400000ULL,0x28002844020000ULL,0x50005008040200ULL,0x20002010080400ULL,0x40004020100800ULL,
      0x20408102000ULL,0x40810204000ULL,0xa1020400000ULL,0x142240000000ULL,0x284402000000ULL,0x500804020000ULL,0x201008040200ULL,0x402010080400ULL,
      0x2040810204000ULL,0x4081020400000ULL,0xa102040000000ULL,0x14224000000000ULL,0x28440200000000ULL,0x50080402000000ULL,0x20100804020000ULL,0x40201008040200ULL},
-  BISHOP_MOVE_MAGICS[64] =
-    {0x40201008040200ULL,0x402010080400ULL,0x4020100a00ULL,0x40221400ULL,0x2442800ULL,0x204085000ULL,0x20408102000ULL,0x2040810204000ULL,
-     0x20100804020000ULL,0x40201008040000ULL,0x4020100a0000ULL,0x4022140000ULL,0x244280000ULL,0x20408500000ULL,0x2040810200000ULL,0x4081020400000ULL,
-     0x10080402000200ULL,0x20100804000400ULL,0x4020100a000a00ULL,0x402214001400ULL,0x24428002800ULL,0x2040850005000ULL,0x4081020002000ULL,0x8102040004000ULL,
-     0x8040200020400ULL,0x10080400040800ULL,0x20100a000a1000ULL,0x40221400142200ULL,0x2442800284400ULL,0x4085000500800ULL,0x8102000201000ULL,0x10204000402000ULL,
-     0x4020002040800ULL,0x8040004081000ULL,0x100a000a102000ULL,0x22140014224000ULL,0x44280028440200ULL,0x8500050080400ULL,0x10200020100800ULL,0x20400040201000ULL,
-     0x2000204081000ULL,0x4000408102000ULL,0xa000a10204000ULL,0x14001422400000ULL,0x28002844020000ULL,0x50005008040200ULL,0x20002010080400ULL,0x40004020100800ULL,
-     0x20408102000ULL,0x40810204000ULL,0xa1020400000ULL,0x142240000000ULL,0x284402000000ULL,0x500804020000ULL,0x201008040200ULL,0x402010080400ULL,
-     0x2040810204000ULL,0x4081020400000ULL,0xa102040000000ULL,0x14224000000000ULL,0x28440200000000ULL,0x50080402000000ULL,0x20100804020000ULL,0x40201008040200ULL},
   ROOK_MAGIC[64] = {
-    0x548001400080106cULL,0x900184000110820ULL,0x428004200a81080ULL,0x140088082000c40ULL,0x1480020800011400ULL,0x100008804085201ULL,0x2a40220001048140ULL,0x50000810000482aULL,
-    0x250020100020a004ULL,0x3101880100900a00ULL,0x200a040a00082002ULL,0x1004300044032084ULL,0x2100408001013ULL,0x21f00440122083ULL,0xa204280406023040ULL,0x2241801020800041ULL,
-    0xe10100800208004ULL,0x2010401410080ULL,0x181482000208805ULL,0x4080101000021c00ULL,0xa250210012080022ULL,0x4210641044000827ULL,0x8081a02300d4010ULL,0x8008012000410001ULL,
-    0x28c0822120108100ULL,0x500160020aa005ULL,0xc11050088c1000ULL,0x48c00101000a288ULL,0x494a184408028200ULL,0x20880100240006ULL,0x10b4010200081ULL,0x40a200260000490cULL,
-    0x22384003800050ULL,0x7102001a008010ULL,0x80020c8010900c0ULL,0x100204082a001060ULL,0x8000118188800428ULL,0x58e0020009140244ULL,0x100145040040188dULL,0x44120220400980ULL,
-    0x114001007a00800ULL,0x80a0100516304000ULL,0x7200301488001000ULL,0x1000151040808018ULL,0x3000a200010e0020ULL,0x1000849180802810ULL,0x829100210208080ULL,0x1004050021528004ULL,
-    0x61482000c41820b0ULL,0x241001018a401a4ULL,0x45020c009cc04040ULL,0x308210c020081200ULL,0xa000215040040ULL,0x10a6024001928700ULL,0x42c204800c804408ULL,0x30441a28614200ULL,
-    0x40100229080420aULL,0x9801084000201103ULL,0x8408622090484202ULL,0x4022001048a0e2ULL,0x280120020049902ULL,0x1200412602009402ULL,0x914900048020884ULL,0x104824281002402ULL},
+    0x1080004008801020ULL,0x840092002c03000ULL,0x1900200010400900ULL,0x880100008000480ULL,0x4200100420080200ULL,0x8100020100080400ULL,0x200040110886200ULL,0x200008040220411ULL,
+    0x404800084400220ULL,0x401000402000ULL,0x86001081220440ULL,0x408800800100280ULL,0xa001201040820ULL,0x8848800200840080ULL,0x4001000100040200ULL,0x442000102105084ULL,
+    0x9080010020804100ULL,0x40404000201009ULL,0x808010002009ULL,0x2200090021d00100ULL,0x8008008040080ULL,0x4004002010040ULL,0x11040008015042ULL,0xa0001768104ULL,
+    0x800080204009ULL,0x2010004140002001ULL,0x9800200280100080ULL,0x1000100080080080ULL,0x442000a00049020ULL,0x2100040080020080ULL,0x800120400900148ULL,0x10040a00128541ULL,
+    0x2800804000800030ULL,0x1010002000400041ULL,0x4000200011004100ULL,0x610008410800800ULL,0x400802402800800ULL,0xc100020080800400ULL,0x2000802000401ULL,0x182085882000401ULL,
+    0x220204000808000ULL,0x2860100040024022ULL,0x1002004110040ULL,0x99101042000a0020ULL,0x4080004008080ULL,0x10040002008080ULL,0x2012004881020004ULL,0x8300842444820011ULL,
+    0x88403882010200ULL,0x820400080210100ULL,0x110910040a00300ULL,0x801100280080480ULL,0x242009008200600ULL,0x1002000489500200ULL,0x40800200010080ULL,0x91800041000080ULL,
+    0x209300488001ULL,0x4c1002414824001ULL,0x20020000b001041ULL,0x7000100004200901ULL,0x8002002004100802ULL,0x30010002084c0007ULL,0x888221800813004ULL,0x4000002840840112ULL},
   BISHOP_MAGIC[64] = {
-    0x2890208600480830ULL,0x324148050f087ULL,0x1402488a86402004ULL,0xc2210a1100044bULL,0x88450040b021110cULL,0xc0407240011ULL,0xd0246940cc101681ULL,0x1022840c2e410060ULL,
-    0x4a1804309028d00bULL,0x821880304a2c0ULL,0x134088090100280ULL,0x8102183814c0208ULL,0x518598604083202ULL,0x67104040408690ULL,0x1010040020d000ULL,0x600001028911902ULL,
-    0x8810183800c504c4ULL,0x2628200121054640ULL,0x28003000102006ULL,0x4100c204842244ULL,0x1221c50102421430ULL,0x80109046e0844002ULL,0xc128600019010400ULL,0x812218030404c38ULL,
-    0x1224152461091c00ULL,0x1c820008124000aULL,0xa004868015010400ULL,0x34c080004202040ULL,0x200100312100c001ULL,0x4030048118314100ULL,0x410000090018ULL,0x142c010480801ULL,
-    0x8080841c1d004262ULL,0x81440f004060406ULL,0x400a090008202ULL,0x2204020084280080ULL,0xb820060400008028ULL,0x110041840112010ULL,0x8002080a1c84400ULL,0x212100111040204aULL,
-    0x9412118200481012ULL,0x804105002001444cULL,0x103001280823000ULL,0x40088e028080300ULL,0x51020d8080246601ULL,0x4a0a100e0804502aULL,0x5042028328010ULL,0xe000808180020200ULL,
-    0x1002020620608101ULL,0x1108300804090c00ULL,0x180404848840841ULL,0x100180040ac80040ULL,0x20840000c1424001ULL,0x82c00400108800ULL,0x28c0493811082aULL,0x214980910400080cULL,
-    0x8d1a0210b0c000ULL,0x164c500ca0410cULL,0xc6040804283004ULL,0x14808001a040400ULL,0x180450800222a011ULL,0x600014600490202ULL,0x21040100d903ULL,0x10404821000420ULL},
+    0x10102002004a1420ULL,0x8020040400584008ULL,0x10510800811201c8ULL,0x5204042080000088ULL,0x2204106880000002ULL,0x1401042004000000ULL,0x400880410042004ULL,0x28208200a02020ULL,
+    0x1500241990010e00ULL,0x8001200182020a40ULL,0x40004101030b0000ULL,0x8002041042000100ULL,0x4010011041020038ULL,0x10421044000ULL,0x1500210808020a00ULL,0x8000088400880520ULL,
+    0x405004010040100ULL,0x1005823210040108ULL,0x2708008102040011ULL,0x4048200404009100ULL,0x18104101400024ULL,0x3000601190101ULL,0x8004803108491000ULL,0x8014241200820800ULL,
+    0x6e080100c3040ULL,0x501044a11041800ULL,0x9020300008004045ULL,0x894080000220040ULL,0x1001010083104000ULL,0x5004030040900080ULL,0x400422c012400ULL,0x2128698404812ULL,
+    0x1010108404900440ULL,0x928021182084100ULL,0x2006080409020024ULL,0x1010202020180080ULL,0xa010008200202200ULL,0x2098015100019004ULL,0x2041440810811ULL,0x802a02020000b098ULL,
+    0x9015090004060ULL,0x4000821082081001ULL,0x100210040420800ULL,0x800004010488a00ULL,0x2000081104004040ULL,0x4c8e029015000082ULL,0x420340322224842ULL,0x1298260043400210ULL,
+    0x822802400008ULL,0x8a0101600000ULL,0x3040003412080021ULL,0x3040290220884800ULL,0x4a1500401041004aULL,0x8010200282020781ULL,0x20203142209091ULL,0x70300600902110ULL,
+    0x40808800b62048ULL,0x810400c44420ULL,0x80400440c0441ULL,0x8340080020840411ULL,0x104208200ULL,0x800810d00080ULL,0x400530411080200ULL,0x4040702400932244ULL},
+  RANDOM_BB_INIT[3]    = {0X12311227ULL, 0X1931311ULL, 0X13138141ULL},
   EVAL_FREE_COLUMNS[8] = {0x0202020202020202ULL,0x0505050505050505ULL,0x0A0A0A0A0A0A0A0AULL,0x1414141414141414ULL,0x2828282828282828ULL,0x5050505050505050ULL,0xA0A0A0A0A0A0A0A0ULL,0x4040404040404040ULL};
 
-// Variables
+static const struct PERFT_T
+  PERFT_SUITE[] = {
+    {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 6, 119060324ULL},
+    {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 5, 193690690ULL},
+    {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 6, 11030083ULL},
+    {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5, 15833292ULL},
+    {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 5, 89941194ULL},
+    {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 5, 164075551ULL},
+    {"bqnb1rkr/pp3ppp/3ppn2/2p5/5P2/P2P4/NPP1P1PP/BQ1BNRKR w HFhf - 2 9", 5, 8146062ULL},
+    {"2nnrbkr/p1qppppp/8/1ppb4/6PP/3PP3/PPP2P2/BQNNRBKR w HEhe - 1 9", 5, 16253601ULL},
+    {"b1q1rrkb/pppppppp/3nn3/8/P7/1PPP4/4PPPP/BQNNRKRB w GE - 1 9", 5, 6417013ULL},
+    {"qbbnnrkr/2pp2pp/p7/1p2pp2/8/P3PP2/1PPP1KPP/QBBNNR1R w hf - 0 9", 5, 9183776ULL},
+    {"1nbbnrkr/p1p1ppp1/3p4/1p3P1p/3Pq2P/8/PPP1P1P1/QNBBNRKR w HFhf - 0 9", 5, 34030312ULL},
+    {"qnbnr1kr/ppp1b1pp/4p3/3p1p2/8/2NPP3/PPP1BPPP/QNB1R1KR w HEhe - 1 9", 5, 24851983ULL}};
+
+static const char
+  *BENCH_FENS[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP1B1PPP/R2QKB1R w KQ - 0 8",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "2r3k1/1q1nbppp/r3p3/3pP3/pPpP4/P1Q2N2/2RN1PPP/2R4K b - - 0 22",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "5rk1/1ppb3p/p1pb4/6q1/3P1p1r/2P1R2P/PP1BQ1P1/5RKN w - - 0 1",
+    "6k1/4pp1p/3p2p1/P1pPb3/R7/1r2P1PP/3B1P2/6K1 w - - 0 1",
+    "8/5pk1/6p1/3P4/2p2P2/2P3P1/6K1/8 w - - 0 40",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/8 b - - 3 54",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1"};
 
-static struct BOARD_T
-  BOARD_TMP = {{0},{0},{0},0,0,0,0,0,0,0,0}, *BOARD = &BOARD_TMP, *MGEN_MOVES = 0, *BOARD_ORIGINAL = 0, ROOT_MOVES[MAX_MOVES] = {{{0},{0},{0},0,0,0,0,0,0,0,0}};
+// Variables
 
 static int
-  MAX_DEPTH = DEPTH_LIMIT, QS_DEPTH = 4, LEVEL = 100, EVAL_POS_MG = 0, EVAL_POS_EG = 0, EVAL_MAT_MG = 0, EVAL_MAT_EG = 0, EVAL_WHITE_KING_SQ = 0,
-  EVAL_BLACK_KING_SQ = 0, EVAL_BOTH_N = 0, TOKENS_N = 0, TOKENS_I = 0, DEPTH = 0, BEST_SCORE = 0, ROOT_MOVES_N = 0, KING_W = 0, KING_B = 0, MGEN_MOVES_N = 0,
-  EVAL_PSQT_MG_B[6][64] = {{0}}, EVAL_PSQT_EG_B[6][64] = {{0}}, ROOK_W[2] = {0}, ROOK_B[2] = {0}, MOVEOVERHEAD = 15,
+  MAX_DEPTH = DEPTH_LIMIT, MULTIPV = 1, HARD_TIME = 0, TM_SOFT = 0, TM_HARD = 0, TM_LIMIT = 0, HASH_AGE = 0, HASH_SIZE_MB = 0, THREADS_N = 1, LEVEL = 100, TOKENS_N = 0, TOKENS_I = 0, KING_W = 0, KING_B = 0,
+  EVAL_PSQT_MG_B[6][64] = {{0}}, EVAL_PSQT_EG_B[6][64] = {{0}}, SCALE[100] = {0}, ROOK_W[2] = {0}, ROOK_B[2] = {0}, MOVEOVERHEAD = 15, LAZY_MARGIN = LAZY_CP,
   MVV[6][6] = {{85,96,97,98,99,100}, {84,86,93,94,95,100}, {82,83,87,91,92,100}, {79,80,81,88,90,100}, {75,76,77,78,89,100}, {70,71,72,73,74,100}};
 
 static char
   FEN[90] = STARTPOS, FEN_SPLITS[5][90] = {{0}}, TOKENS[MAX_TOKENS][90] = {{0}};
 
-static float
-  EVAL_DRAWISH_FACTOR = 1.0f, SCALE[100] = {0};
+static int64_t
+  EVAL_PIECE_SQ[13][64] = {{0}};
 
 static uint64_t
-  EVAL_WHITE = 0, EVAL_BLACK = 0, EVAL_EMPTY = 0, EVAL_BOTH = 0, MGEN_BLACK = 0, MGEN_BOTH = 0, MGEN_EMPTY = 0, MGEN_GOOD = 0, MGEN_PAWN_SQ = 0, MGEN_WHITE = 0,
-  STOP_SEARCH_TIME = 0, NODES = 0, PAWN_1_MOVES_W[64] = {0}, PAWN_1_MOVES_B[64] = {0}, PAWN_2_MOVES_W[64] = {0}, PAWN_2_MOVES_B[64] = {0}, ZOBRIST_EP[64]= {0},
+  STOP_SEARCH_TIME = 0, TM_START = 0, PAWN_1_MOVES_W[64] = {0}, PAWN_1_MOVES_B[64] = {0}, PAWN_2_MOVES_W[64] = {0}, PAWN_2_MOVES_B[64] = {0}, ZOBRIST_EP[64]= {0},
   ZOBRIST_CASTLE[16] = {0}, ZOBRIST_WTM[2] = {0}, ZOBRIST_BOARD[13][64] = {{0}}, CASTLE_W[2] = {0}, CASTLE_B[2] = {0}, CASTLE_EMPTY_W[2] = {0},
   CASTLE_EMPTY_B[2] = {0}, EVAL_KING_RING[64] = {0}, EVAL_COLUMNS_UP[64] = {0}, EVAL_COLUMNS_DOWN[64] = {0}, BISHOP_MOVES[64] = {0}, ROOK_MOVES[64] = {0},
-  QUEEN_MOVES[64] = {0}, KNIGHT_MOVES[64] = {0}, KING_MOVES[64] = {0}, PAWN_CHECKS_W[64] = {0}, PAWN_CHECKS_B[64] = {0}, REPETITION_POSITIONS[128] = {0},
-  BISHOP_MAGIC_MOVES[64][512] = {{0}}, ROOK_MAGIC_MOVES[64][4096] = {{0}}, RANDOM_SEED = 131783;
+  QUEEN_MOVES[64] = {0}, KNIGHT_MOVES[64] = {0}, KING_MOVES[64] = {0}, PAWN_CHECKS_W[64] = {0}, PAWN_CHECKS_B[64] = {0},
+  SLIDER_MOVES[SLIDER_MOVES_N] = {0}, BETWEEN[64][64] = {{0}}, LINE[64][64] = {{0}},
+  MAX_NODES = 0;
 
 static bool
-  CHESS960 = false, WTM = false, STOP_SEARCH = false, UNDERPROMOS = true, ANALYZING = false;
+  CHESS960 = false, WTM = false, PONDERING = false, PONDER = false, SILENT = false, HASH_HUGE = false, USE_NNUE = false, NNUE_ON = false, SHOW_STATS = false;
+
+static volatile bool
+  STOP_SEARCH = false, PONDER_HIT = false; // Set by the input thread on "ponderhit"
+
+static volatile int
+  USER_STOP = 0; // Lines read before the last "stop". Only the input thread writes it
 
 static struct HASH_T
-  HASH[HASH_KEY + 1] = {{0,0,0,0,0,0}};
+  *HASH = 0; // Clusters of 4 entries (64 bytes)
+
+static uint64_t
+  HASH_KEY = 0, HASH_BYTES = 0;
+
+static struct EVAL_HASH_T
+  EVAL_HASH[EVAL_KEY + 1] = {{0,0}};
+
+static struct PAWN_HASH_T
+  PAWN_HASH[PAWN_KEY + 1] = {{0,0}};
+
+static struct THREAD_T
+  THREADS[MAX_THREADS];
+
+static struct SLIDER_T
+  BISHOP_SLIDERS[64], ROOK_SLIDERS[64];
+
+static char
+  NNUE_FILE[256] = "sapeli.nnue";
+
+static uint64_t
+  PERFT_COUNTS[MAX_MOVES] = {0}, PERFT_KEY = 0;
+
+static int
+  PERFT_DEPTH = 0, PERFT_NEXT = 0;
+
+static bool
+  PERFT_HASH = true;
+
+static pthread_mutex_t
+  PERFT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static const int16_t
+  *NNUE_FT_WEIGHTS = 0, *NNUE_FT_BIASES = 0, *NNUE_OUT_WEIGHTS = 0; // Point into the weights file
+
+static void
+  *NNUE_DATA = 0;
+
+static int
+  NNUE_OUT_BIAS = 0;
+
+static int
+  EPD_SOLVED = 0, EPD_DONE = 0;
+
+static uint64_t
+  EPD_NODES = 0;
+
+static char
+  **INPUT_QUEUE = 0, INPUT_LINE[INPUT_SIZE] = {0}; // Grows, so the reader never waits for the search
+
+static int
+  INPUT_I = 0, INPUT_N = 0, INPUT_CAP = 0, INPUT_SEARCHES = 0, // INPUT_SEARCHES: "go" commands read but not finished
+  INPUT_READ = 0, INPUT_SEQ = 0;                             // Lines queued / taken. INPUT_SEQ: Number of the current command
+
+static bool
+  INPUT_EOF = false;
+
+static pthread_mutex_t
+  INPUT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t
+  INPUT_COND = PTHREAD_COND_INITIALIZER; // Signaled on a new line or EOF
+
+// Search state (One copy per thread)
+
+static _Thread_local struct BOARD_T
+  BOARD_TMP = {{0},{0},0,0,0,{0},0,0,0}, *BOARD = 0;
+
+static _Thread_local struct MOVE_T
+  *MGEN_MOVES = 0, ROOT_MOVES[MAX_MOVES] = {{0,0}};
+
+static _Thread_local int
+  QS_DEPTH = 4, EVAL_DRAWISH = 100, EVAL_WHITE_KING_SQ = 0, EVAL_BLACK_KING_SQ = 0, EVAL_BOTH_N = 0,
+  MGEN_KING = 0, MGEN_MOVES_N = 0, DEPTH = 0, BEST_SCORE = 0, ROOT_MOVES_N = 0, THREAD_ID = 0;
+
+static _Thread_local int64_t
+  EVAL_SCORE = 0;
+
+static _Thread_local uint64_t
+  EVAL_WHITE = 0, EVAL_BLACK = 0, EVAL_EMPTY = 0, EVAL_BOTH = 0, MGEN_BLACK = 0, MGEN_BOTH = 0, MGEN_EMPTY = 0, MGEN_GOOD = 0, MGEN_PAWN_SQ = 0, MGEN_WHITE = 0,
+  MGEN_PINNED = 0, MGEN_CHECK_MASK = 0, NODES = 0, REPETITION_POSITIONS[128] = {0}, RANDOM_SEED = 131783, RANDOM_BB[3] = {0};
+
+static _Thread_local struct STATS_T
+  STATS = {0};
+
+static _Thread_local bool
+  UNDERPROMOS = true;
+
+static _Thread_local uint16_t
+  KILLERS[DEPTH_LIMIT][2] = {{0}};
+
+static _Thread_local struct NNUE_ACC_T
+  NNUE_STACK[NNUE_PLIES]; // One per ply. Make pushes the feature changes, Eval applies them lazily
+
+static _Thread_local int
+  NNUE_PLY = 0;
 
 // Prototypes
 
@@ -260,28 +575,31 @@ static inline int PopCount(const uint64_t bb) {
   return __builtin_popcountll(bb);
 }
 
-static uint64_t BishopMagicIndex(const int pos, const uint64_t mask) {
-  return ((mask & BISHOP_MASK[pos]) * BISHOP_MAGIC[pos]) >> 55;
-}
-
-static uint64_t RookMagicIndex(const int pos, const uint64_t mask) {
-  return ((mask & ROOK_MASK[pos]) * ROOK_MAGIC[pos]) >> 52;
+// Fancy magics: Per square shift into one shared table. Same layout with PEXT
+static inline uint64_t MagicIndex(const struct SLIDER_T *const slider, const uint64_t mask) {
+#ifdef PEXT
+  return _pext_u64(mask, slider->mask);
+#else
+  return ((mask & slider->mask) * slider->magic) >> slider->shift;
+#endif
 }
 
-static uint64_t BishopMagicMoves(const int pos, const uint64_t mask) {
-  return BISHOP_MAGIC_MOVES[pos][BishopMagicIndex(pos, mask)];
+static inline uint64_t BishopMagicMoves(const int pos, const uint64_t mask) {
+  return BISHOP_SLIDERS[pos].moves[MagicIndex(&BISHOP_SLIDERS[pos], mask)];
 }
 
-static uint64_t RookMagicMoves(const int pos, const uint64_t mask) {
-  return ROOK_MAGIC_MOVES[pos][RookMagicIndex(pos, mask)];
+static inline uint64_t RookMagicMoves(const int pos, const uint64_t mask) {
+  return ROOK_SLIDERS[pos].moves[MagicIndex(&ROOK_SLIDERS[pos], mask)];
 }
 
+// One call per line. The input thread prints too
 static void Print(const char *const format, ...) {
+  char str[INPUT_SIZE] = "";
   va_list va;
   va_start(va, format);
-  vfprintf(stdout, format, va);
+  vsnprintf(str, sizeof(str), format, va);
   va_end(va);
-  fprintf(stdout, "\n");
+  fprintf(stdout, "%s\n", str);
   fflush(stdout);
 }
 
@@ -307,16 +625,36 @@ static uint64_t Now(void) {
   return gettimeofday(&tv, NULL) ? 0x0ULL : (uint64_t) (1000 * tv.tv_sec + tv.tv_usec / 1000);
 }
 
+// Deadline checks. Ticks of a few ms, but no syscall on Linux (vDSO)
+static uint64_t NowCoarse(void) {
+#ifdef CLOCK_MONOTONIC_COARSE
+  struct timespec ts;
+  return clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) ? 0x0ULL : (uint64_t) (1000 * ts.tv_sec + ts.tv_nsec / 1000000);
+#else
+  return Now();
+#endif
+}
+
+static uint64_t NowUs(void) {
+  struct timeval tv;
+  return gettimeofday(&tv, NULL) ? 0x0ULL : (uint64_t) (1000000 * tv.tv_sec + tv.tv_usec);
+}
+
 static uint64_t Mixer(const uint64_t val) {
   return (val << 7) ^ (val >> 5);
 }
 
 static uint64_t RandomBB(void) {
-  static uint64_t va = 0X12311227ULL, vb = 0X1931311ULL, vc = 0X13138141ULL;
-  va ^= vb + vc;
-  vb ^= vb * vc + 0x1717711ULL;
-  vc  = (3 * vc) + 1;
-  return Mixer(va) ^ Mixer(vb) ^ Mixer(vc);
+  uint64_t *const va = &RANDOM_BB[0], *const vb = &RANDOM_BB[1], *const vc = &RANDOM_BB[2];
+  *va ^= *vb + *vc;
+  *vb ^= *vb * *vc + 0x1717711ULL;
+  *vc  = (3 * *vc) + 1;
+  return Mixer(*va) ^ Mixer(*vb) ^ Mixer(*vc);
+}
+
+static void RandomReset(const uint64_t seed) {
+  RANDOM_SEED = seed;
+  memcpy(RANDOM_BB, RANDOM_BB_INIT, sizeof(RANDOM_BB));
 }
 
 static uint64_t Random8x64(void) {
@@ -336,26 +674,27 @@ static int Random(const int x, const int y) {
   return x + RandomMax(y - x + 1);
 }
 
-static void Input(void) {
-  static char str[8192] = "";
-  str[0] = '\0';
-  Assert(fgets(str, sizeof(str), stdin) != NULL, "Error #1: Read line returns NULL !");
-  CreateTokens(str);
+// Move type: 0: Normal, 1: OOw, 2: OOOw, 3: OOb, 4: OOOb, 5: =n, 6: =b, 7: =r, 8: =q
+static inline uint16_t Move(const int from, const int to, const int type) {
+  return (uint16_t) (from | (to << 6) | (type << 12));
 }
 
-static char PromoLetter(const char piece) {
-  switch (Abs(piece)) {
-  case 2:  return 'n';
-  case 3:  return 'b';
-  case 4:  return 'r';
-  default: return 'q';
-  }
+static inline int MoveFrom(const uint16_t move) {
+  return move & 0x3F;
+}
+
+static inline int MoveTo(const uint16_t move) {
+  return (move >> 6) & 0x3F;
+}
+
+static inline int MoveType(const uint16_t move) {
+  return move >> 12;
 }
 
-static const char *MoveName(const struct BOARD_T *const move) {
+static const char *MoveName(const uint16_t move) {
   static char str[6] = "";
-  int from = move->from, to = move->to;
-  switch (move->type) {
+  int from = MoveFrom(move), to = MoveTo(move);
+  switch (MoveType(move)) {
   case 1:
     from = KING_W;
     to   = CHESS960 ? ROOK_W[0] : 6;
@@ -374,7 +713,7 @@ static const char *MoveName(const struct BOARD_T *const move) {
     break;
   case 5: case 6: case 7: case 8:
     strcpy(str, MoveStr(from, to));
-    str[4] = PromoLetter(move->board[to]);
+    str[4] = "nbrq"[MoveType(move) - 5];
     str[5] = '\0';
     return str;
   }
@@ -396,8 +735,8 @@ static inline uint64_t Both(void) {
 
 // Hash
 
-static inline uint64_t Hash(const bool wtm) {
-  uint64_t hash = ZOBRIST_EP[BOARD->epsq + 1] ^ ZOBRIST_WTM[wtm ? 1 : 0] ^ ZOBRIST_CASTLE[BOARD->castle], both = Both();
+static uint64_t HashFull(void) {
+  uint64_t hash = ZOBRIST_EP[BOARD->epsq + 1] ^ ZOBRIST_CASTLE[BOARD->castle], both = Both();
   for (; both; both = ClearBit(both)) {
     const int sq = Ctz(both);
     hash ^= ZOBRIST_BOARD[BOARD->board[sq] + 6][sq];
@@ -405,6 +744,226 @@ static inline uint64_t Hash(const bool wtm) {
   return hash;
 }
 
+static uint64_t HashPawnsFull(void) {
+  uint64_t hash = 0;
+  for (uint64_t pawns = BOARD->white[0] | BOARD->black[0]; pawns; pawns = ClearBit(pawns)) {
+    const int sq = Ctz(pawns);
+    hash ^= ZOBRIST_BOARD[BOARD->board[sq] + 6][sq];
+  }
+  return hash;
+}
+
+// Keys are updated incrementally by the move generator. Debug builds verify them
+static inline uint64_t Hash(const bool wtm) {
+#ifndef NDEBUG
+  Assert(BOARD->hash == HashFull() && BOARD->pawn_hash == HashPawnsFull(), "Error #5: Bad hash !");
+#endif
+  return BOARD->hash ^ ZOBRIST_WTM[wtm ? 1 : 0];
+}
+
+static inline void HashPiece(const int piece, const int sq) {
+  BOARD->hash ^= ZOBRIST_BOARD[piece + 6][sq];
+  if (piece == 1 || piece == -1)
+    BOARD->pawn_hash ^= ZOBRIST_BOARD[piece + 6][sq];
+}
+
+static inline void HashEp(void) {
+  BOARD->hash ^= ZOBRIST_EP[BOARD->epsq + 1];
+}
+
+static inline void HashCastle(void) {
+  BOARD->hash ^= ZOBRIST_CASTLE[BOARD->castle];
+}
+
+// NNUE
+
+// 768 -> 2 x 256 -> 1. File: NNUE_MAGIC, 2 x uint32 (Inputs, hidden), then int16 (Little endian):
+// Feature weights [768][256], feature biases [256], output weights [2 x 256] (Side to move first), output bias
+
+static inline int NnueFeature(const int piece, const int sq, const int side) {
+  return side ? 64 * ((piece < 0 ? 0 : 6) + Abs(piece) - 1) + (sq ^ 56) : 64 * ((piece > 0 ? 0 : 6) + Abs(piece) - 1) + sq;
+}
+
+static inline void NnueAdd(const int piece, const int sq) {
+  struct NNUE_ACC_T *const acc = &NNUE_STACK[NNUE_PLY];
+  acc->add[acc->add_n][0] = NnueFeature(piece, sq, 0);
+  acc->add[acc->add_n][1] = NnueFeature(piece, sq, 1);
+  acc->add_n++;
+}
+
+static inline void NnueRemove(const int piece, const int sq) {
+  struct NNUE_ACC_T *const acc = &NNUE_STACK[NNUE_PLY];
+  acc->sub[acc->sub_n][0] = NnueFeature(piece, sq, 0);
+  acc->sub[acc->sub_n][1] = NnueFeature(piece, sq, 1);
+  acc->sub_n++;
+}
+
+static void NnuePush(void) {
+  struct NNUE_ACC_T *const acc = &NNUE_STACK[++NNUE_PLY];
+  acc->add_n = acc->sub_n = 0;
+  acc->computed = false;
+}
+
+// Root of the stack is refreshed on the next eval
+static void NnueReset(void) {
+  NNUE_PLY = 0;
+  NNUE_STACK[0].computed = false;
+}
+
+static inline void NnueRow(int16_t *const acc, const int feature, const int sign) {
+  const int16_t *const row = NNUE_FT_WEIGHTS + NNUE_HIDDEN * feature;
+  for (int i = 0; i < NNUE_HIDDEN; i++)
+    acc[i] += sign * row[i];
+}
+
+static void NnueRefresh(struct NNUE_ACC_T *const acc) {
+  for (int side = 0; side < 2; side++) {
+    memcpy(acc->acc[side], NNUE_FT_BIASES, sizeof(acc->acc[side]));
+    for (uint64_t both = Both(); both; both = ClearBit(both)) {
+      const int sq = Ctz(both);
+      NnueRow(acc->acc[side], NnueFeature(BOARD->board[sq], sq, side), +1);
+    }
+  }
+  acc->computed = true;
+}
+
+static void NnueApply(struct NNUE_ACC_T *const acc, const struct NNUE_ACC_T *const parent) {
+  for (int side = 0; side < 2; side++) {
+    memcpy(acc->acc[side], parent->acc[side], sizeof(acc->acc[side]));
+    for (int i = 0; i < acc->add_n; i++)
+      NnueRow(acc->acc[side], acc->add[i][side], +1);
+    for (int i = 0; i < acc->sub_n; i++)
+      NnueRow(acc->acc[side], acc->sub[i][side], -1);
+  }
+  acc->computed = true;
+}
+
+// From the last computed ply forward. Full refresh if there is none
+static void NnueUpdate(void) {
+  int ply = NNUE_PLY;
+  while (ply > 0 && !NNUE_STACK[ply].computed)
+    ply--;
+  if (!NNUE_STACK[ply].computed) {
+    NnueRefresh(&NNUE_STACK[NNUE_PLY]);
+    return;
+  }
+  for (ply++; ply <= NNUE_PLY; ply++)
+    NnueApply(&NNUE_STACK[ply], &NNUE_STACK[ply - 1]);
+}
+
+// Sum of clamp(acc, 0, QA) * weight. AVX2: 16 lanes per step with int16 x int16 -> int32 madd
+static int NnueOutput(const int16_t *const acc, const int16_t *const weights) {
+#ifdef __AVX2__
+  const __m256i zero = _mm256_setzero_si256(), qa = _mm256_set1_epi16(NNUE_QA);
+  __m256i sum = zero;
+  for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+    const __m256i x = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i *) (acc + i)), zero), qa);
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x, _mm256_loadu_si256((const __m256i *) (weights + i))));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+  return _mm_cvtsi128_si32(half);
+#else
+  int sum = 0;
+  for (int i = 0; i < NNUE_HIDDEN; i++)
+    sum += Between(0, acc[i], NNUE_QA) * weights[i];
+  return sum;
+#endif
+}
+
+static int NnueEval(const bool wtm) {
+  NnueUpdate();
+  const struct NNUE_ACC_T *const acc = &NNUE_STACK[NNUE_PLY];
+#ifndef NDEBUG
+  struct NNUE_ACC_T full;
+  NnueRefresh(&full);
+  Assert(!memcmp(full.acc, acc->acc, sizeof(full.acc)), "Error #9: Bad NNUE accumulator !");
+#endif
+  const int us = wtm ? 0 : 1;
+  const int64_t sum = (int64_t) NnueOutput(acc->acc[us], NNUE_OUT_WEIGHTS) + NnueOutput(acc->acc[!us], NNUE_OUT_WEIGHTS + NNUE_HIDDEN)
+                      + NNUE_QA * NNUE_OUT_BIAS;
+  const int score = (int) ((10 * NNUE_SCALE * sum) / (NNUE_QA * NNUE_QB)); // 1 cp = 10
+  return wtm ? score : -score;
+}
+
+static void NnueFree(void) {
+  if (!NNUE_DATA)
+    return;
+#ifdef WINDOWS
+  free(NNUE_DATA);
+#else
+  munmap(NNUE_DATA, NNUE_BYTES);
+#endif
+  NNUE_DATA = 0;
+}
+
+// Mapped read only and shared by all threads. Windows reads it into memory
+static bool NnueLoad(const char *const file) {
+#ifdef WINDOWS
+  FILE *const f = fopen(file, "rb");
+  if (!f)
+    return false;
+  NNUE_DATA = malloc(NNUE_BYTES);
+  const bool ok = NNUE_DATA && fread(NNUE_DATA, 1, NNUE_BYTES, f) == NNUE_BYTES && fgetc(f) == EOF;
+  fclose(f);
+#else
+  const int fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  const bool ok = !fstat(fd, &st) && st.st_size == NNUE_BYTES
+                  && (NNUE_DATA = mmap(NULL, NNUE_BYTES, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED;
+  close(fd);
+  if (NNUE_DATA == MAP_FAILED)
+    NNUE_DATA = 0;
+#endif
+  if (!ok || memcmp(NNUE_DATA, NNUE_MAGIC, 8) || ((const uint32_t *) NNUE_DATA)[2] != NNUE_INPUTS || ((const uint32_t *) NNUE_DATA)[3] != NNUE_HIDDEN) {
+    NnueFree();
+    return false;
+  }
+  NNUE_FT_WEIGHTS  = (const int16_t *) ((const char *) NNUE_DATA + 16);
+  NNUE_FT_BIASES   = NNUE_FT_WEIGHTS + NNUE_INPUTS * NNUE_HIDDEN;
+  NNUE_OUT_WEIGHTS = NNUE_FT_BIASES + NNUE_HIDDEN;
+  NNUE_OUT_BIAS    = NNUE_OUT_WEIGHTS[2 * NNUE_HIDDEN];
+  return true;
+}
+
+// Cached evals are from the other evaluator
+static void NnueSetup(void) {
+  NnueFree();
+  NNUE_ON = USE_NNUE && NnueLoad(NNUE_FILE);
+  if (USE_NNUE)
+    Print("info string NNUE %s %s", NNUE_FILE, NNUE_ON ? "loaded" : "not loaded");
+  memset(EVAL_HASH, 0, sizeof(EVAL_HASH));
+  NnueReset();
+}
+
+// Material + PSQT
+
+static int64_t MaterialFull(void) {
+  int64_t score = 0;
+  for (uint64_t both = Both(); both; both = ClearBit(both)) {
+    const int sq = Ctz(both);
+    score += EVAL_PIECE_SQ[BOARD->board[sq] + 6][sq];
+  }
+  return score;
+}
+
+static inline void PieceAdd(const int piece, const int sq) {
+  HashPiece(piece, sq);
+  BOARD->score += EVAL_PIECE_SQ[piece + 6][sq];
+  if (NNUE_ON)
+    NnueAdd(piece, sq);
+}
+
+static inline void PieceRemove(const int piece, const int sq) {
+  HashPiece(piece, sq);
+  BOARD->score -= EVAL_PIECE_SQ[piece + 6][sq];
+  if (NNUE_ON)
+    NnueRemove(piece, sq);
+}
+
 // Tokenizer
 
 static void TokenAdd(const char *const token) {
@@ -579,7 +1138,7 @@ static void FenCreate(const char *const fen) {
 }
 
 static void FenReset(void) {
-  const struct BOARD_T brd = {{0},{0},{0},0,0,0,0,0,0,0,0};
+  const struct BOARD_T brd = {{0},{0},0,0,0,{0},0,0,0};
   BOARD_TMP   = brd;
   BOARD       = &BOARD_TMP;
   WTM         = true;
@@ -598,6 +1157,10 @@ static void Fen(const char *fen) {
   FenReset();
   FenCreate(fen);
   BuildBitboards();
+  BOARD->hash      = HashFull();
+  BOARD->pawn_hash = HashPawnsFull();
+  BOARD->score     = MaterialFull();
+  NnueReset();
   Assert(BoardOk(), "Error #3: Bad board !");
 }
 
@@ -645,10 +1208,10 @@ static inline bool ChecksB(void) {
 
 // Sorting
 
-static inline void Swap(struct BOARD_T *const brda, struct BOARD_T *const brdb) {
-  const struct BOARD_T tmp = *brda;
-  *brda = *brdb;
-  *brdb = tmp;
+static inline void Swap(struct MOVE_T *const mova, struct MOVE_T *const movb) {
+  const struct MOVE_T tmp = *mova;
+  *mova = *movb;
+  *movb = tmp;
 }
 
 static void SortNthMoves(const int nth) {
@@ -658,331 +1221,429 @@ static void SortNthMoves(const int nth) {
         Swap(MGEN_MOVES + j, MGEN_MOVES + i);
 }
 
-static int EvaluateMoves(void) {
-  int tactics = 0;
-  for (int i = 0; i < MGEN_MOVES_N; i++) {
-    if (MGEN_MOVES[i].score)
-      tactics++;
-    MGEN_MOVES[i].index = i;
-  }
-  return tactics;
-}
-
 static void SortAll(void) {
   SortNthMoves(MGEN_MOVES_N);
 }
 
-static void SortByHash(const struct HASH_T *const entry, const uint64_t hash) {
-  if (entry->sort_hash == hash) {
-    if (entry->killer)
-      MGEN_MOVES[entry->killer - 1].score += 10000;
-    else if (entry->good)
-      MGEN_MOVES[entry->good - 1].score += 500;
-    if (entry->quiet)
-      MGEN_MOVES[entry->quiet - 1].score += 1000;
-  }
-  SortNthMoves(EvaluateMoves());
+// Moves the best remaining move to index and returns it
+static struct MOVE_T *SortNext(struct MOVE_T *const moves, const int index, const int moves_n) {
+  for (int i = index + 1; i < moves_n; i++)
+    if (moves[i].score > moves[index].score)
+      Swap(moves + i, moves + index);
+  return moves + index;
 }
 
-static void EvaluateRootMoves(void) {
-  struct BOARD_T *const tmp = BOARD;
-  for (int i = 0; i < ROOT_MOVES_N; i++) {
-    BOARD = ROOT_MOVES + i;
-    BOARD->score += (BOARD->type >= 5 && BOARD->type <= 7 ? -10000 : 0)
-                    + (BOARD->type >= 1 && BOARD->type <= 4 ? 5000 : 0)
-                    + ((WTM ? 1 : -1) * Eval(WTM))
-                    + Random(-2, +2);
-  }
-  BOARD = tmp;
-}
+// Make / Unmake
 
-static void SortRoot(const int index) {
-  if (!index)
-    return;
-  const struct BOARD_T tmp = ROOT_MOVES[index];
-  for (int i = index; i > 0; i--)
-    ROOT_MOVES[i] = ROOT_MOVES[i - 1];
-  ROOT_MOVES[0] = tmp;
+static void CheckCastlingRightsW(void) {
+  if (BOARD->board[KING_W]    != +6) {BOARD->castle &= 4 | 8; return;}
+  if (BOARD->board[ROOK_W[0]] != +4) {BOARD->castle &= 2 | 4 | 8;}
+  if (BOARD->board[ROOK_W[1]] != +4) {BOARD->castle &= 1 | 4 | 8;}
 }
 
-// Move generator
-
-static void HandleCastlingW(const int mtype, const int from, const int to) {
-  MGEN_MOVES[MGEN_MOVES_N] = *BOARD;
-  BOARD          = &MGEN_MOVES[MGEN_MOVES_N];
-  BOARD->score   = 0;
-  BOARD->epsq    = -1;
-  BOARD->from    = from;
-  BOARD->to      = to;
-  BOARD->type    = mtype;
-  BOARD->castle &= 4 | 8;
-  BOARD->rule50  = 0;
+static void CheckCastlingRightsB(void) {
+  if (BOARD->board[KING_B]    != -6) {BOARD->castle &= 1 | 2; return;}
+  if (BOARD->board[ROOK_B[0]] != -4) {BOARD->castle &= 1 | 2 | 8;}
+  if (BOARD->board[ROOK_B[1]] != -4) {BOARD->castle &= 1 | 2 | 4;}
 }
 
-static void AddCastleOOW(void) {
-  if (ChecksCastleB(CASTLE_W[0]))
-    return;
-  HandleCastlingW(1, KING_W, 6);
-  BOARD->board[ROOK_W[0]] = 0;
-  BOARD->board[KING_W]    = 0;
-  BOARD->board[5]         = 4;
-  BOARD->board[6]         = 6;
-  BOARD->white[3]         = (BOARD->white[3] ^ Bit(ROOK_W[0])) | Bit(5);
-  BOARD->white[5]         = (BOARD->white[5] ^ Bit(KING_W))    | Bit(6);
-  if (ChecksB())
+static void HandleCastlingRights(void) {
+  if (!BOARD->castle)
     return;
-  MGEN_MOVES_N++;
+  HashCastle();
+  CheckCastlingRightsW();
+  CheckCastlingRightsB();
+  HashCastle();
+}
+
+static void MakeCastleW(const int rook, const int king_to, const int rook_to) {
+  BOARD->board[rook]    = 0;
+  BOARD->board[KING_W]  = 0;
+  BOARD->board[rook_to] = 4;
+  BOARD->board[king_to] = 6;
+  BOARD->white[3]       = (BOARD->white[3] ^ Bit(rook))   | Bit(rook_to);
+  BOARD->white[5]       = (BOARD->white[5] ^ Bit(KING_W)) | Bit(king_to);
+  BOARD->rule50         = 0;
+  PieceRemove(4, rook);
+  PieceRemove(6, KING_W);
+  PieceAdd(4, rook_to);
+  PieceAdd(6, king_to);
+  HashCastle();
+  BOARD->castle &= 4 | 8;
+  HashCastle();
+}
+
+static void UnmakeCastleW(const int rook, const int king_to, const int rook_to) {
+  BOARD->board[rook_to] = 0;
+  BOARD->board[king_to] = 0;
+  BOARD->board[rook]    = 4;
+  BOARD->board[KING_W]  = 6;
+  BOARD->white[3]       = (BOARD->white[3] ^ Bit(rook_to)) | Bit(rook);
+  BOARD->white[5]       = (BOARD->white[5] ^ Bit(king_to)) | Bit(KING_W);
+}
+
+static void MakeCastleB(const int rook, const int king_to, const int rook_to) {
+  BOARD->board[rook]    = 0;
+  BOARD->board[KING_B]  = 0;
+  BOARD->board[rook_to] = -4;
+  BOARD->board[king_to] = -6;
+  BOARD->black[3]       = (BOARD->black[3] ^ Bit(rook))   | Bit(rook_to);
+  BOARD->black[5]       = (BOARD->black[5] ^ Bit(KING_B)) | Bit(king_to);
+  BOARD->rule50         = 0;
+  PieceRemove(-4, rook);
+  PieceRemove(-6, KING_B);
+  PieceAdd(-4, rook_to);
+  PieceAdd(-6, king_to);
+  HashCastle();
+  BOARD->castle &= 1 | 2;
+  HashCastle();
 }
 
-static void AddCastleOOOW(void) {
-  if (ChecksCastleB(CASTLE_W[1]))
-    return;
-  HandleCastlingW(2, KING_W, 2);
-  BOARD->board[ROOK_W[1]] = 0;
-  BOARD->board[KING_W]    = 0;
-  BOARD->board[3]         = 4;
-  BOARD->board[2]         = 6;
-  BOARD->white[3]         = (BOARD->white[3] ^ Bit(ROOK_W[1])) | Bit(3);
-  BOARD->white[5]         = (BOARD->white[5] ^ Bit(KING_W))    | Bit(2);
-  if (ChecksB())
-    return;
-  MGEN_MOVES_N++;
+static void UnmakeCastleB(const int rook, const int king_to, const int rook_to) {
+  BOARD->board[rook_to] = 0;
+  BOARD->board[king_to] = 0;
+  BOARD->board[rook]    = -4;
+  BOARD->board[KING_B]  = -6;
+  BOARD->black[3]       = (BOARD->black[3] ^ Bit(rook_to)) | Bit(rook);
+  BOARD->black[5]       = (BOARD->black[5] ^ Bit(king_to)) | Bit(KING_B);
 }
 
-static void MgenCastlingMovesW(void) {
-  if ((BOARD->castle & 1) && !(CASTLE_EMPTY_W[0] & MGEN_BOTH)) {
-    AddCastleOOW();
-    BOARD = BOARD_ORIGINAL;
-  }
-  if ((BOARD->castle & 2) && !(CASTLE_EMPTY_W[1] & MGEN_BOTH)) {
-    AddCastleOOOW();
-    BOARD = BOARD_ORIGINAL;
+static void MakePromotionW(const int from, const int to, const int piece, const int eat) {
+  BOARD->board[from]       = 0;
+  BOARD->board[to]         = piece;
+  BOARD->white[0]         ^= Bit(from);
+  BOARD->white[piece - 1] |= Bit(to);
+  BOARD->rule50            = 0;
+  PieceRemove(1, from);
+  PieceAdd(piece, to);
+  if (eat <= -1) {
+    BOARD->black[-eat - 1] ^= Bit(to);
+    PieceRemove(eat, to);
   }
 }
 
-static void HandleCastlingB(const int mtype, const int from, const int to) {
-  MGEN_MOVES[MGEN_MOVES_N] = *BOARD;
-  BOARD          = &MGEN_MOVES[MGEN_MOVES_N];
-  BOARD->score   = 0;
-  BOARD->epsq    = -1;
-  BOARD->from    = from;
-  BOARD->to      = to;
-  BOARD->type    = mtype;
-  BOARD->castle &= 1 | 2;
-  BOARD->rule50  = 0;
+static void UnmakePromotionW(const int from, const int to, const int piece, const int eat) {
+  BOARD->board[from]       = 1;
+  BOARD->board[to]         = eat;
+  BOARD->white[0]         |= Bit(from);
+  BOARD->white[piece - 1] ^= Bit(to);
+  if (eat <= -1)
+    BOARD->black[-eat - 1] |= Bit(to);
 }
 
-static void AddCastleOOB(void) {
-  if (ChecksCastleW(CASTLE_B[0]))
-    return;
-  HandleCastlingB(3, KING_B, 56 + 6);
-  BOARD->board[ROOK_B[0]] = 0;
-  BOARD->board[KING_B]    = 0;
-  BOARD->board[56 + 5]    = -4;
-  BOARD->board[56 + 6]    = -6;
-  BOARD->black[3]         = (BOARD->black[3] ^ Bit(ROOK_B[0])) | Bit(56 + 5);
-  BOARD->black[5]         = (BOARD->black[5] ^ Bit(KING_B))    | Bit(56 + 6);
-  if (ChecksW())
-    return;
-  MGEN_MOVES_N++;
-}
-
-static void AddCastleOOOB(void) {
-  if (ChecksCastleW(CASTLE_B[1]))
-    return;
-  HandleCastlingB(4, KING_B, 56 + 2);
-  BOARD->board[ROOK_B[1]] = 0;
-  BOARD->board[KING_B]    = 0;
-  BOARD->board[56 + 3]    = -4;
-  BOARD->board[56 + 2]    = -6;
-  BOARD->black[3]         = (BOARD->black[3] ^ Bit(ROOK_B[1])) | Bit(56 + 3);
-  BOARD->black[5]         = (BOARD->black[5] ^ Bit(KING_B))    | Bit(56 + 2);
-  if (ChecksW())
-    return;
-  MGEN_MOVES_N++;
-}
-
-static void MgenCastlingMovesB(void) {
-  if ((BOARD->castle & 4) && !(CASTLE_EMPTY_B[0] & MGEN_BOTH)) {
-    AddCastleOOB();
-    BOARD = BOARD_ORIGINAL;
-  }
-  if ((BOARD->castle & 8) && !(CASTLE_EMPTY_B[1] & MGEN_BOTH)) {
-    AddCastleOOOB();
-    BOARD = BOARD_ORIGINAL;
+static void MakePromotionB(const int from, const int to, const int piece, const int eat) {
+  BOARD->board[from]        = 0;
+  BOARD->board[to]          = piece;
+  BOARD->black[0]          ^= Bit(from);
+  BOARD->black[-piece - 1] |= Bit(to);
+  BOARD->rule50             = 0;
+  PieceRemove(-1, from);
+  PieceAdd(piece, to);
+  if (eat >= 1) {
+    BOARD->white[eat - 1] ^= Bit(to);
+    PieceRemove(eat, to);
   }
 }
 
-static void CheckCastlingRightsW(void) {
-  if (BOARD->board[KING_W]    != +6) {BOARD->castle &= 4 | 8; return;}
-  if (BOARD->board[ROOK_W[0]] != +4) {BOARD->castle &= 2 | 4 | 8;}
-  if (BOARD->board[ROOK_W[1]] != +4) {BOARD->castle &= 1 | 4 | 8;}
-}
-
-static void CheckCastlingRightsB(void) {
-  if (BOARD->board[KING_B]    != -6) {BOARD->castle &= 1 | 2; return;}
-  if (BOARD->board[ROOK_B[0]] != -4) {BOARD->castle &= 1 | 2 | 8;}
-  if (BOARD->board[ROOK_B[1]] != -4) {BOARD->castle &= 1 | 2 | 4;}
-}
-
-static void HandleCastlingRights(void) {
-  if (!BOARD->castle)
-    return;
-  CheckCastlingRightsW();
-  CheckCastlingRightsB();
+static void UnmakePromotionB(const int from, const int to, const int piece, const int eat) {
+  BOARD->board[from]        = -1;
+  BOARD->board[to]          = eat;
+  BOARD->black[0]          |= Bit(from);
+  BOARD->black[-piece - 1] ^= Bit(to);
+  if (eat >= 1)
+    BOARD->white[eat - 1] |= Bit(to);
 }
 
-static void ModifyPawnStuffW(const int from, const int to) {
+static void MakePawnStuffW(const int from, const int to, const int epsq) {
   BOARD->rule50 = 0;
-  if (to == BOARD_ORIGINAL->epsq) {
-    BOARD->score         = 85;
+  if (to == epsq) {
     BOARD->board[to - 8] = 0;
     BOARD->black[0]     ^= Bit(to - 8);
-  } else if (Ycoord(to) - Ycoord(from) == 2) {
+    PieceRemove(-1, to - 8);
+  } else if (to - from == 16) {
     BOARD->epsq = to - 8;
-  } else if (Ycoord(to) == 6) { // Pawn on 7th is tactical
-    BOARD->score = 102;
-  }
-}
-
-static void AddPromotionW(const int from, const int to, const int piece) {
-  const int eat = BOARD->board[to];
-  MGEN_MOVES[MGEN_MOVES_N] = *BOARD;
-  BOARD = &MGEN_MOVES[MGEN_MOVES_N];
-  BOARD->from        = from;
-  BOARD->to          = to;
-  BOARD->score       = 100;
-  BOARD->type        = 3 + piece;
-  BOARD->epsq        = -1;
-  BOARD->rule50      = 0;
-  BOARD->board[to]   = piece;
-  BOARD->board[from] = 0;
-  BOARD->white[0]   ^= Bit(from);
-  BOARD->white[piece - 1] |= Bit(to);
-  if (eat <= -1)
-    BOARD->black[-eat - 1] ^= Bit(to);
-  if (ChecksB())
-    return;
-  HandleCastlingRights();
-  MGEN_MOVES_N++;
-}
-
-static void AddPromotionStuffW(const int from, const int to) {
-  if (!UNDERPROMOS) { // = q
-    AddPromotionW(from, to, 5);
-    return;
-  }
-  struct BOARD_T *const tmp = BOARD;
-  for (int piece = 2; piece <= 5; piece++) { // =nbrq
-    AddPromotionW(from, to, piece);
-    BOARD = tmp;
   }
 }
 
-static void AddNormalStuffW(const int from, const int to) {
-  const int me = BOARD->board[from], eat = BOARD->board[to];
-  MGEN_MOVES[MGEN_MOVES_N] = *BOARD;
-  BOARD = &MGEN_MOVES[MGEN_MOVES_N];
-  BOARD->from          = from;
-  BOARD->to            = to;
-  BOARD->score         = 0;
-  BOARD->type          = 0;
-  BOARD->epsq          = -1;
+static void MakeNormalW(const int from, const int to, const int me, const int eat, const int epsq) {
   BOARD->board[from]   = 0;
   BOARD->board[to]     = me;
   BOARD->white[me - 1] = (BOARD->white[me - 1] ^ Bit(from)) | Bit(to);
   BOARD->rule50++;
+  PieceRemove(me, from);
+  PieceAdd(me, to);
   if (eat <= -1) {
     BOARD->black[-eat - 1] ^= Bit(to);
-    BOARD->score  = MVV[me - 1][-eat - 1];
     BOARD->rule50 = 0;
+    PieceRemove(eat, to);
   }
-  if (BOARD->board[to] == 1)
-    ModifyPawnStuffW(from, to);
-  if (ChecksB())
-    return;
-  HandleCastlingRights();
-  MGEN_MOVES_N++;
+  if (me == 1)
+    MakePawnStuffW(from, to, epsq);
 }
 
-static void AddW(const int from, const int to) {
-  if (BOARD->board[from] == 1 && Ycoord(from) == 6)
-    AddPromotionStuffW(from, to);
-  else
-    AddNormalStuffW(from, to);
+static void UnmakeNormalW(const int from, const int to, const int eat, const int epsq) {
+  const int me = BOARD->board[to];
+  BOARD->board[to]     = eat;
+  BOARD->board[from]   = me;
+  BOARD->white[me - 1] = (BOARD->white[me - 1] ^ Bit(to)) | Bit(from);
+  if (eat <= -1) {
+    BOARD->black[-eat - 1] |= Bit(to);
+  } else if (me == 1 && to == epsq) {
+    BOARD->board[to - 8] = -1;
+    BOARD->black[0]     |= Bit(to - 8);
+  }
 }
 
-static void ModifyPawnStuffB(const int from, const int to) {
+static void MakePawnStuffB(const int from, const int to, const int epsq) {
   BOARD->rule50 = 0;
-  if (to == BOARD_ORIGINAL->epsq) {
-    BOARD->score         = 85;
+  if (to == epsq) {
     BOARD->board[to + 8] = 0;
     BOARD->white[0]     ^= Bit(to + 8);
-  } else if (Ycoord(to) - Ycoord(from) == -2) {
+    PieceRemove(+1, to + 8);
+  } else if (from - to == 16) {
     BOARD->epsq = to + 8;
-  } else if (Ycoord(to) == 1) {
-    BOARD->score = 102;
   }
 }
 
-static void AddNormalStuffB(const int from, const int to) {
-  const int me = BOARD->board[from], eat = BOARD->board[to];
-  MGEN_MOVES[MGEN_MOVES_N] = *BOARD;
-  BOARD                 = &MGEN_MOVES[MGEN_MOVES_N];
-  BOARD->from           = from;
-  BOARD->to             = to;
-  BOARD->score          = 0;
-  BOARD->type           = 0;
-  BOARD->epsq           = -1;
-  BOARD->board[to]      = me;
+static void MakeNormalB(const int from, const int to, const int me, const int eat, const int epsq) {
   BOARD->board[from]    = 0;
+  BOARD->board[to]      = me;
   BOARD->black[-me - 1] = (BOARD->black[-me - 1] ^ Bit(from)) | Bit(to);
   BOARD->rule50++;
+  PieceRemove(me, from);
+  PieceAdd(me, to);
   if (eat >= 1) {
     BOARD->white[eat - 1] ^= Bit(to);
-    BOARD->score  = MVV[-me - 1][eat - 1];
     BOARD->rule50 = 0;
+    PieceRemove(eat, to);
   }
-  if (BOARD->board[to] == -1)
-    ModifyPawnStuffB(from, to);
-  if (ChecksW())
-    return;
+  if (me == -1)
+    MakePawnStuffB(from, to, epsq);
+}
+
+static void UnmakeNormalB(const int from, const int to, const int eat, const int epsq) {
+  const int me = BOARD->board[to];
+  BOARD->board[to]      = eat;
+  BOARD->board[from]    = me;
+  BOARD->black[-me - 1] = (BOARD->black[-me - 1] ^ Bit(to)) | Bit(from);
+  if (eat >= 1) {
+    BOARD->white[eat - 1] |= Bit(to);
+  } else if (me == -1 && to == epsq) {
+    BOARD->board[to + 8] = 1;
+    BOARD->white[0]     |= Bit(to + 8);
+  }
+}
+
+static void MakeSetup(const int to, struct UNDO_T *const undo) {
+  undo->hash      = BOARD->hash;
+  undo->pawn_hash = BOARD->pawn_hash;
+  undo->score  = BOARD->score;
+  undo->eat    = BOARD->board[to];
+  undo->epsq   = BOARD->epsq;
+  undo->castle = BOARD->castle;
+  undo->rule50 = BOARD->rule50;
+  HashEp();
+  BOARD->epsq  = -1;
+  if (NNUE_ON)
+    NnuePush();
+}
+
+static void UnmakeSetup(const struct UNDO_T *const undo) {
+  BOARD->hash      = undo->hash;
+  BOARD->pawn_hash = undo->pawn_hash;
+  BOARD->score  = undo->score;
+  BOARD->epsq   = undo->epsq;
+  BOARD->castle = undo->castle;
+  BOARD->rule50 = undo->rule50;
+  if (NNUE_ON)
+    NNUE_PLY--;
+}
+
+static void MakeMoveW(const uint16_t move, struct UNDO_T *const undo) {
+  const int from = MoveFrom(move), to = MoveTo(move);
+  MakeSetup(to, undo);
+  switch (MoveType(move)) {
+  case 1:  MakeCastleW(ROOK_W[0], 6, 5); break;
+  case 2:  MakeCastleW(ROOK_W[1], 2, 3); break;
+  case 5: case 6: case 7: case 8:
+    MakePromotionW(from, to, MoveType(move) - 3, undo->eat);
+    break;
+  default: MakeNormalW(from, to, BOARD->board[from], undo->eat, undo->epsq); break;
+  }
+  HashEp();
   HandleCastlingRights();
+}
+
+static void UnmakeMoveW(const uint16_t move, const struct UNDO_T *const undo) {
+  const int from = MoveFrom(move), to = MoveTo(move);
+  switch (MoveType(move)) {
+  case 1:  UnmakeCastleW(ROOK_W[0], 6, 5); break;
+  case 2:  UnmakeCastleW(ROOK_W[1], 2, 3); break;
+  case 5: case 6: case 7: case 8:
+    UnmakePromotionW(from, to, MoveType(move) - 3, undo->eat);
+    break;
+  default: UnmakeNormalW(from, to, undo->eat, undo->epsq); break;
+  }
+  UnmakeSetup(undo);
+}
+
+static void MakeMoveB(const uint16_t move, struct UNDO_T *const undo) {
+  const int from = MoveFrom(move), to = MoveTo(move);
+  MakeSetup(to, undo);
+  switch (MoveType(move)) {
+  case 3:  MakeCastleB(ROOK_B[0], 56 + 6, 56 + 5); break;
+  case 4:  MakeCastleB(ROOK_B[1], 56 + 2, 56 + 3); break;
+  case 5: case 6: case 7: case 8:
+    MakePromotionB(from, to, -(MoveType(move) - 3), undo->eat);
+    break;
+  default: MakeNormalB(from, to, BOARD->board[from], undo->eat, undo->epsq); break;
+  }
+  HashEp();
+  HandleCastlingRights();
+}
+
+static void UnmakeMoveB(const uint16_t move, const struct UNDO_T *const undo) {
+  const int from = MoveFrom(move), to = MoveTo(move);
+  switch (MoveType(move)) {
+  case 3:  UnmakeCastleB(ROOK_B[0], 56 + 6, 56 + 5); break;
+  case 4:  UnmakeCastleB(ROOK_B[1], 56 + 2, 56 + 3); break;
+  case 5: case 6: case 7: case 8:
+    UnmakePromotionB(from, to, -(MoveType(move) - 3), undo->eat);
+    break;
+  default: UnmakeNormalB(from, to, undo->eat, undo->epsq); break;
+  }
+  UnmakeSetup(undo);
+}
+
+static void EvaluateRootMoves(void) {
+  struct UNDO_T undo;
+  for (int i = 0; i < ROOT_MOVES_N; i++) {
+    const uint16_t move = ROOT_MOVES[i].move;
+    const int type = MoveType(move);
+    WTM ? MakeMoveW(move, &undo) : MakeMoveB(move, &undo);
+    ROOT_MOVES[i].score += (type >= 5 && type <= 7 ? -10000 : 0)
+                           + (type >= 1 && type <= 4 ? 5000 : 0)
+                           + ((WTM ? 1 : -1) * Eval(WTM))
+                           + Random(-2, +2);
+    WTM ? UnmakeMoveW(move, &undo) : UnmakeMoveB(move, &undo);
+  }
+}
+
+static void SortRoot(const int index) {
+  if (!index)
+    return;
+  const struct MOVE_T tmp = ROOT_MOVES[index];
+  for (int i = index; i > 0; i--)
+    ROOT_MOVES[i] = ROOT_MOVES[i - 1];
+  ROOT_MOVES[0] = tmp;
+}
+
+// Searched move at index among the searched ones. Best first, ties keep their order
+static void SortRootScore(const int index) {
+  const struct MOVE_T tmp = ROOT_MOVES[index];
+  int i = index;
+  for (; i > 0 && ROOT_MOVES[i - 1].score < tmp.score; i--)
+    ROOT_MOVES[i] = ROOT_MOVES[i - 1];
+  ROOT_MOVES[i] = tmp;
+}
+
+// Move generator
+
+// Other moves are legal by construction (Pins and check mask)
+static bool KingMoveOkW(const uint16_t move) {
+  struct UNDO_T undo;
+  MakeMoveW(move, &undo);
+  const bool checks = ChecksB();
+  UnmakeMoveW(move, &undo);
+  return !checks;
+}
+
+static void AddMoveW(const int from, const int to, const int type, const int score) {
+  const uint16_t move = Move(from, to, type);
+  if ((from == MGEN_KING || (to == BOARD->epsq && BOARD->board[from] == +1)) && !KingMoveOkW(move))
+    return;
+  MGEN_MOVES[MGEN_MOVES_N].move  = move;
+  MGEN_MOVES[MGEN_MOVES_N].score = score;
   MGEN_MOVES_N++;
 }
 
-static void AddPromotionB(const int from, const int to, const int piece) {
-  const int eat = BOARD->board[to];
-  MGEN_MOVES[MGEN_MOVES_N] = *BOARD;
-  BOARD = &MGEN_MOVES[MGEN_MOVES_N];
-  BOARD->from        = from;
-  BOARD->to          = to;
-  BOARD->score       = 100;
-  BOARD->type        = 3 + (-piece);
-  BOARD->epsq        = -1;
-  BOARD->rule50      = 0;
-  BOARD->board[from] = 0;
-  BOARD->board[to]   = piece;
-  BOARD->black[0]   ^= Bit(from);
-  BOARD->black[-piece - 1] |= Bit(to);
-  if (eat >= 1)
-    BOARD->white[eat - 1] ^= Bit(to);
-  if (ChecksW())
+// Other moves are legal by construction (Pins and check mask)
+static bool KingMoveOkB(const uint16_t move) {
+  struct UNDO_T undo;
+  MakeMoveB(move, &undo);
+  const bool checks = ChecksW();
+  UnmakeMoveB(move, &undo);
+  return !checks;
+}
+
+static void AddMoveB(const int from, const int to, const int type, const int score) {
+  const uint16_t move = Move(from, to, type);
+  if ((from == MGEN_KING || (to == BOARD->epsq && BOARD->board[from] == -1)) && !KingMoveOkB(move))
     return;
-  HandleCastlingRights();
+  MGEN_MOVES[MGEN_MOVES_N].move  = move;
+  MGEN_MOVES[MGEN_MOVES_N].score = score;
   MGEN_MOVES_N++;
 }
 
+static void MgenCastlingMovesW(void) {
+  if ((BOARD->castle & 1) && !(CASTLE_EMPTY_W[0] & MGEN_BOTH) && !ChecksCastleB(CASTLE_W[0]))
+    AddMoveW(KING_W, 6, 1, 0);
+  if ((BOARD->castle & 2) && !(CASTLE_EMPTY_W[1] & MGEN_BOTH) && !ChecksCastleB(CASTLE_W[1]))
+    AddMoveW(KING_W, 2, 2, 0);
+}
+
+static void MgenCastlingMovesB(void) {
+  if ((BOARD->castle & 4) && !(CASTLE_EMPTY_B[0] & MGEN_BOTH) && !ChecksCastleW(CASTLE_B[0]))
+    AddMoveB(KING_B, 56 + 6, 3, 0);
+  if ((BOARD->castle & 8) && !(CASTLE_EMPTY_B[1] & MGEN_BOTH) && !ChecksCastleW(CASTLE_B[1]))
+    AddMoveB(KING_B, 56 + 2, 4, 0);
+}
+
+static void AddPromotionStuffW(const int from, const int to) {
+  if (!UNDERPROMOS) { // = q
+    AddMoveW(from, to, 8, 100);
+    return;
+  }
+  for (int piece = 2; piece <= 5; piece++) // =nbrq
+    AddMoveW(from, to, 3 + piece, 100);
+}
+
+static int PawnScoreW(const int to, const int score) {
+  if (to == BOARD->epsq)
+    return 85;
+  return Ycoord(to) == 6 ? 102 : score; // Pawn on 7th is tactical
+}
+
+static void AddNormalStuffW(const int from, const int to) {
+  const int me = BOARD->board[from], eat = BOARD->board[to], score = eat <= -1 ? MVV[me - 1][-eat - 1] : 0;
+  AddMoveW(from, to, 0, me == 1 ? PawnScoreW(to, score) : score);
+}
+
+static void AddW(const int from, const int to) {
+  if (BOARD->board[from] == 1 && Ycoord(from) == 6)
+    AddPromotionStuffW(from, to);
+  else
+    AddNormalStuffW(from, to);
+}
+
 static void AddPromotionStuffB(const int from, const int to) {
   if (!UNDERPROMOS) {
-    AddPromotionB(from, to, -5);
+    AddMoveB(from, to, 8, 100);
     return;
   }
-  struct BOARD_T *const tmp = BOARD;
-  for (int piece = 2; piece <= 5; piece++) {
-    AddPromotionB(from, to, -piece);
-    BOARD = tmp;
-  }
+  for (int piece = 2; piece <= 5; piece++)
+    AddMoveB(from, to, 3 + piece, 100);
+}
+
+static int PawnScoreB(const int to, const int score) {
+  if (to == BOARD->epsq)
+    return 85;
+  return Ycoord(to) == 1 ? 102 : score;
+}
+
+static void AddNormalStuffB(const int from, const int to) {
+  const int me = BOARD->board[from], eat = BOARD->board[to], score = eat >= 1 ? MVV[-me - 1][eat - 1] : 0;
+  AddMoveB(from, to, 0, me == -1 ? PawnScoreB(to, score) : score);
 }
 
 static void AddB(const int from, const int to) {
@@ -993,17 +1654,33 @@ static void AddB(const int from, const int to) {
 }
 
 static void AddMovesW(const int from, uint64_t moves) {
-  for (; moves; moves = ClearBit(moves)) {
+  for (; moves; moves = ClearBit(moves))
     AddW(from, Ctz(moves));
-    BOARD = BOARD_ORIGINAL;
-  }
 }
 
 static void AddMovesB(const int from, uint64_t moves) {
-  for (; moves; moves = ClearBit(moves)) {
+  for (; moves; moves = ClearBit(moves))
     AddB(from, Ctz(moves));
-    BOARD = BOARD_ORIGINAL;
+}
+
+// Pinned pieces may only move along the pin. Under check only captures and blocks
+static void MgenPinsAndChecks(const uint64_t own, const uint64_t checkers, uint64_t snipers) {
+  MGEN_PINNED = 0;
+  for (; snipers; snipers = ClearBit(snipers)) {
+    const uint64_t between = BETWEEN[MGEN_KING][Ctz(snipers)] & MGEN_BOTH;
+    if (PopCount(between) == 1)
+      MGEN_PINNED |= between & own;
   }
+  if (!checkers)
+    MGEN_CHECK_MASK = ~0x0ULL;
+  else if (ClearBit(checkers)) // Double check -> King moves only
+    MGEN_CHECK_MASK = 0;
+  else
+    MGEN_CHECK_MASK = checkers | BETWEEN[MGEN_KING][Ctz(checkers)];
+}
+
+static inline uint64_t MgenMask(const int sq) {
+  return MGEN_CHECK_MASK & (Bit(sq) & MGEN_PINNED ? LINE[MGEN_KING][sq] : ~0x0ULL);
 }
 
 static void MgenSetupW(void) {
@@ -1012,6 +1689,14 @@ static void MgenSetupW(void) {
   MGEN_BOTH    = MGEN_WHITE | MGEN_BLACK;
   MGEN_EMPTY   = ~MGEN_BOTH;
   MGEN_PAWN_SQ = MGEN_BLACK | (BOARD->epsq > 0 ? Bit(BOARD->epsq) & 0x0000FF0000000000ULL : 0x0ULL);
+  MGEN_KING    = Ctz(BOARD->white[5]);
+  MgenPinsAndChecks(MGEN_WHITE,
+    (PAWN_CHECKS_W[MGEN_KING] & BOARD->black[0])
+    | (KNIGHT_MOVES[MGEN_KING] & BOARD->black[1])
+    | (BishopMagicMoves(MGEN_KING, MGEN_BOTH) & (BOARD->black[2] | BOARD->black[4]))
+    | (RookMagicMoves(MGEN_KING, MGEN_BOTH) & (BOARD->black[3] | BOARD->black[4])),
+    (BISHOP_MOVES[MGEN_KING] & (BOARD->black[2] | BOARD->black[4]))
+    | (ROOK_MOVES[MGEN_KING] & (BOARD->black[3] | BOARD->black[4])));
 }
 
 static void MgenSetupB(void) {
@@ -1020,17 +1705,25 @@ static void MgenSetupB(void) {
   MGEN_BOTH    = MGEN_WHITE | MGEN_BLACK;
   MGEN_EMPTY   = ~MGEN_BOTH;
   MGEN_PAWN_SQ = MGEN_WHITE | (BOARD->epsq > 0 ? Bit(BOARD->epsq) & 0x0000000000FF0000ULL : 0x0ULL);
+  MGEN_KING    = Ctz(BOARD->black[5]);
+  MgenPinsAndChecks(MGEN_BLACK,
+    (PAWN_CHECKS_B[MGEN_KING] & BOARD->white[0])
+    | (KNIGHT_MOVES[MGEN_KING] & BOARD->white[1])
+    | (BishopMagicMoves(MGEN_KING, MGEN_BOTH) & (BOARD->white[2] | BOARD->white[4]))
+    | (RookMagicMoves(MGEN_KING, MGEN_BOTH) & (BOARD->white[3] | BOARD->white[4])),
+    (BISHOP_MOVES[MGEN_KING] & (BOARD->white[2] | BOARD->white[4]))
+    | (ROOK_MOVES[MGEN_KING] & (BOARD->white[3] | BOARD->white[4])));
 }
 
 static void MgenPawnsW(void) {
   for (uint64_t pieces = BOARD->white[0]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesW(sq, PAWN_CHECKS_W[sq] & MGEN_PAWN_SQ);
+    AddMovesW(sq, PAWN_CHECKS_W[sq] & MGEN_PAWN_SQ & (MgenMask(sq) | MGEN_EMPTY));
     if (Ycoord(sq) == 1) {
       if (PAWN_1_MOVES_W[sq] & MGEN_EMPTY)
-        AddMovesW(sq, PAWN_2_MOVES_W[sq] & MGEN_EMPTY);
+        AddMovesW(sq, PAWN_2_MOVES_W[sq] & MGEN_EMPTY & MgenMask(sq));
     } else {
-      AddMovesW(sq, PAWN_1_MOVES_W[sq] & MGEN_EMPTY);
+      AddMovesW(sq, PAWN_1_MOVES_W[sq] & MGEN_EMPTY & MgenMask(sq));
     }
   }
 }
@@ -1038,12 +1731,12 @@ static void MgenPawnsW(void) {
 static void MgenPawnsB(void) {
   for (uint64_t pieces = BOARD->black[0]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesB(sq, PAWN_CHECKS_B[sq] & MGEN_PAWN_SQ);
+    AddMovesB(sq, PAWN_CHECKS_B[sq] & MGEN_PAWN_SQ & (MgenMask(sq) | MGEN_EMPTY));
     if (Ycoord(sq) == 6) {
       if (PAWN_1_MOVES_B[sq] & MGEN_EMPTY)
-        AddMovesB(sq, PAWN_2_MOVES_B[sq] & MGEN_EMPTY);
+        AddMovesB(sq, PAWN_2_MOVES_B[sq] & MGEN_EMPTY & MgenMask(sq));
     } else {
-      AddMovesB(sq, PAWN_1_MOVES_B[sq] & MGEN_EMPTY);
+      AddMovesB(sq, PAWN_1_MOVES_B[sq] & MGEN_EMPTY & MgenMask(sq));
     }
   }
 }
@@ -1051,58 +1744,58 @@ static void MgenPawnsB(void) {
 static void MgenPawnsOnlyCapturesW(void) {
   for (uint64_t pieces = BOARD->white[0]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesW(sq, Ycoord(sq) == 6 ? PAWN_1_MOVES_W[sq] & (~MGEN_BOTH)
-                                  : PAWN_CHECKS_W[sq] & MGEN_PAWN_SQ);
+    AddMovesW(sq, Ycoord(sq) == 6 ? PAWN_1_MOVES_W[sq] & (~MGEN_BOTH) & MgenMask(sq)
+                                  : PAWN_CHECKS_W[sq] & MGEN_PAWN_SQ & (MgenMask(sq) | MGEN_EMPTY));
   }
 }
 
 static void MgenPawnsOnlyCapturesB(void) {
   for (uint64_t pieces = BOARD->black[0]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesB(sq, Ycoord(sq) == 1 ? PAWN_1_MOVES_B[sq] & (~MGEN_BOTH)
-                                  : PAWN_CHECKS_B[sq] & MGEN_PAWN_SQ);
+    AddMovesB(sq, Ycoord(sq) == 1 ? PAWN_1_MOVES_B[sq] & (~MGEN_BOTH) & MgenMask(sq)
+                                  : PAWN_CHECKS_B[sq] & MGEN_PAWN_SQ & (MgenMask(sq) | MGEN_EMPTY));
   }
 }
 
 static void MgenKnightsW(void) {
   for (uint64_t pieces = BOARD->white[1]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesW(sq, KNIGHT_MOVES[sq] & MGEN_GOOD);
+    AddMovesW(sq, KNIGHT_MOVES[sq] & MGEN_GOOD & MgenMask(sq));
   }
 }
 
 static void MgenKnightsB(void) {
   for (uint64_t pieces = BOARD->black[1]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesB(sq, KNIGHT_MOVES[sq] & MGEN_GOOD);
+    AddMovesB(sq, KNIGHT_MOVES[sq] & MGEN_GOOD & MgenMask(sq));
   }
 }
 
 static void MgenBishopsPlusQueensW(void) {
   for (uint64_t pieces = BOARD->white[2] | BOARD->white[4]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesW(sq, BishopMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD);
+    AddMovesW(sq, BishopMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD & MgenMask(sq));
   }
 }
 
 static void MgenBishopsPlusQueensB(void) {
   for (uint64_t pieces = BOARD->black[2] | BOARD->black[4]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesB(sq, BishopMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD);
+    AddMovesB(sq, BishopMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD & MgenMask(sq));
   }
 }
 
 static void MgenRooksPlusQueensW(void) {
   for (uint64_t pieces = BOARD->white[3] | BOARD->white[4]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesW(sq, RookMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD);
+    AddMovesW(sq, RookMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD & MgenMask(sq));
   }
 }
 
 static void MgenRooksPlusQueensB(void) {
   for (uint64_t pieces = BOARD->black[3] | BOARD->black[4]; pieces; pieces = ClearBit(pieces)) {
     const int sq = Ctz(pieces);
-    AddMovesB(sq, RookMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD);
+    AddMovesB(sq, RookMagicMoves(sq, MGEN_BOTH) & MGEN_GOOD & MgenMask(sq));
   }
 }
 
@@ -1138,6 +1831,119 @@ static void MgenAllB(void) {
   MgenCastlingMovesB();
 }
 
+static void MgenPawnsTacticsW(void) {
+  for (uint64_t pieces = BOARD->white[0]; pieces; pieces = ClearBit(pieces)) {
+    const int sq = Ctz(pieces);
+    AddMovesW(sq, PAWN_CHECKS_W[sq] & MGEN_PAWN_SQ & (MgenMask(sq) | MGEN_EMPTY));
+    if (Ycoord(sq) >= 5) // To 7th or promotion
+      AddMovesW(sq, PAWN_1_MOVES_W[sq] & MGEN_EMPTY & MgenMask(sq));
+  }
+}
+
+static void MgenPawnsTacticsB(void) {
+  for (uint64_t pieces = BOARD->black[0]; pieces; pieces = ClearBit(pieces)) {
+    const int sq = Ctz(pieces);
+    AddMovesB(sq, PAWN_CHECKS_B[sq] & MGEN_PAWN_SQ & (MgenMask(sq) | MGEN_EMPTY));
+    if (Ycoord(sq) <= 2)
+      AddMovesB(sq, PAWN_1_MOVES_B[sq] & MGEN_EMPTY & MgenMask(sq));
+  }
+}
+
+static void MgenPawnsQuietsW(void) {
+  for (uint64_t pieces = BOARD->white[0]; pieces; pieces = ClearBit(pieces)) {
+    const int sq = Ctz(pieces);
+    if (Ycoord(sq) == 1) {
+      if (PAWN_1_MOVES_W[sq] & MGEN_EMPTY)
+        AddMovesW(sq, PAWN_2_MOVES_W[sq] & MGEN_EMPTY & MgenMask(sq));
+    } else if (Ycoord(sq) < 5) {
+      AddMovesW(sq, PAWN_1_MOVES_W[sq] & MGEN_EMPTY & MgenMask(sq));
+    }
+  }
+}
+
+static void MgenPawnsQuietsB(void) {
+  for (uint64_t pieces = BOARD->black[0]; pieces; pieces = ClearBit(pieces)) {
+    const int sq = Ctz(pieces);
+    if (Ycoord(sq) == 6) {
+      if (PAWN_1_MOVES_B[sq] & MGEN_EMPTY)
+        AddMovesB(sq, PAWN_2_MOVES_B[sq] & MGEN_EMPTY & MgenMask(sq));
+    } else if (Ycoord(sq) > 2) {
+      AddMovesB(sq, PAWN_1_MOVES_B[sq] & MGEN_EMPTY & MgenMask(sq));
+    }
+  }
+}
+
+// Tactics: Captures, promotions and pawns to 7th
+static void MgenAllTacticsW(void) {
+  MgenSetupW();
+  MGEN_GOOD = MGEN_BLACK;
+  MgenPawnsTacticsW();
+  MgenKnightsW();
+  MgenBishopsPlusQueensW();
+  MgenRooksPlusQueensW();
+  MgenKingW();
+}
+
+static void MgenAllTacticsB(void) {
+  MgenSetupB();
+  MGEN_GOOD = MGEN_WHITE;
+  MgenPawnsTacticsB();
+  MgenKnightsB();
+  MgenBishopsPlusQueensB();
+  MgenRooksPlusQueensB();
+  MgenKingB();
+}
+
+// Quiets: Everything else
+static void MgenAllQuietsW(void) {
+  MgenSetupW();
+  MGEN_GOOD = MGEN_EMPTY;
+  MgenPawnsQuietsW();
+  MgenKnightsW();
+  MgenBishopsPlusQueensW();
+  MgenRooksPlusQueensW();
+  MgenKingW();
+  MgenCastlingMovesW();
+}
+
+static void MgenAllQuietsB(void) {
+  MgenSetupB();
+  MGEN_GOOD = MGEN_EMPTY;
+  MgenPawnsQuietsB();
+  MgenKnightsB();
+  MgenBishopsPlusQueensB();
+  MgenRooksPlusQueensB();
+  MgenKingB();
+  MgenCastlingMovesB();
+}
+
+// Evasions: Captures of the checker and blocks (Check mask) or king moves
+static void MgenAllEvasionsW(void) {
+  MgenSetupW();
+  if (MGEN_CHECK_MASK) { // Double check -> King moves only
+    MGEN_GOOD = ~MGEN_WHITE & MGEN_CHECK_MASK;
+    MgenPawnsW();
+    MgenKnightsW();
+    MgenBishopsPlusQueensW();
+    MgenRooksPlusQueensW();
+  }
+  MGEN_GOOD = ~MGEN_WHITE;
+  MgenKingW();
+}
+
+static void MgenAllEvasionsB(void) {
+  MgenSetupB();
+  if (MGEN_CHECK_MASK) {
+    MGEN_GOOD = ~MGEN_BLACK & MGEN_CHECK_MASK;
+    MgenPawnsB();
+    MgenKnightsB();
+    MgenBishopsPlusQueensB();
+    MgenRooksPlusQueensB();
+  }
+  MGEN_GOOD = ~MGEN_BLACK;
+  MgenKingB();
+}
+
 static void MgenAllCapturesW(void) {
   MgenSetupW();
   MGEN_GOOD = MGEN_BLACK;
@@ -1158,44 +1964,82 @@ static void MgenAllCapturesB(void) {
   MgenKingB();
 }
 
-static int MgenW(struct BOARD_T *const moves) {
-  MGEN_MOVES_N   = 0;
-  MGEN_MOVES     = moves;
-  BOARD_ORIGINAL = BOARD;
+static int MgenW(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
   MgenAllW();
   return MGEN_MOVES_N;
 }
 
-static int MgenB(struct BOARD_T *const moves) {
-  MGEN_MOVES_N   = 0;
-  MGEN_MOVES     = moves;
-  BOARD_ORIGINAL = BOARD;
+static int MgenB(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
   MgenAllB();
   return MGEN_MOVES_N;
 }
 
-static int MgenCapturesW(struct BOARD_T *const moves) {
-  MGEN_MOVES_N   = 0;
-  MGEN_MOVES     = moves;
-  BOARD_ORIGINAL = BOARD;
+static int MgenCapturesW(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
   MgenAllCapturesW();
   return MGEN_MOVES_N;
 }
 
-static int MgenCapturesB(struct BOARD_T *const moves) {
-  MGEN_MOVES_N   = 0;
-  MGEN_MOVES     = moves;
-  BOARD_ORIGINAL = BOARD;
+static int MgenCapturesB(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
   MgenAllCapturesB();
   return MGEN_MOVES_N;
 }
 
-static int MgenTacticalW(struct BOARD_T *const moves) {
-  return ChecksB() ? MgenW(moves) : MgenCapturesW(moves);
+static int MgenTacticsW(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
+  MgenAllTacticsW();
+  return MGEN_MOVES_N;
+}
+
+static int MgenTacticsB(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
+  MgenAllTacticsB();
+  return MGEN_MOVES_N;
+}
+
+static int MgenQuietsW(struct MOVE_T *const moves, const int moves_n) {
+  MGEN_MOVES_N = moves_n;
+  MGEN_MOVES   = moves;
+  MgenAllQuietsW();
+  return MGEN_MOVES_N;
+}
+
+static int MgenQuietsB(struct MOVE_T *const moves, const int moves_n) {
+  MGEN_MOVES_N = moves_n;
+  MGEN_MOVES   = moves;
+  MgenAllQuietsB();
+  return MGEN_MOVES_N;
+}
+
+static int MgenEvasionsW(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
+  MgenAllEvasionsW();
+  return MGEN_MOVES_N;
+}
+
+static int MgenEvasionsB(struct MOVE_T *const moves) {
+  MGEN_MOVES_N = 0;
+  MGEN_MOVES   = moves;
+  MgenAllEvasionsB();
+  return MGEN_MOVES_N;
+}
+
+static int MgenTacticalW(struct MOVE_T *const moves) {
+  return ChecksB() ? MgenEvasionsW(moves) : MgenCapturesW(moves);
 }
 
-static int MgenTacticalB(struct BOARD_T *const moves) {
-  return ChecksW() ? MgenB(moves) : MgenCapturesB(moves);
+static int MgenTacticalB(struct MOVE_T *const moves) {
+  return ChecksW() ? MgenEvasionsB(moves) : MgenCapturesB(moves);
 }
 
 static void MgenRoot(void) {
@@ -1208,47 +2052,222 @@ static void MgenRootAll(void) {
   SortAll();
 }
 
-// Evaluation
+// Move picker
 
-static int EvalClose(const int sq_a, const int sq_b) {
-  const int ret = 7 - Max(Abs(Xcoord(sq_a) - Xcoord(sq_b)), Abs(Ycoord(sq_a) - Ycoord(sq_b)));
-  return ret * ret;
+static bool PawnMoveOkW(const int from, const int to) {
+  const uint64_t both = Both();
+  if (PAWN_CHECKS_W[from] & Bit(to))
+    return Bit(to) & (Black() | (BOARD->epsq > 0 ? Bit(BOARD->epsq) & 0x0000FF0000000000ULL : 0x0ULL));
+  if (to == from + 8)
+    return !(Bit(to) & both);
+  return to == from + 16 && Ycoord(from) == 1 && !((Bit(from + 8) | Bit(to)) & both);
 }
 
-static void MixScoreW(const int mg, const int eg) {
-  EVAL_POS_MG += mg;
-  EVAL_POS_EG += eg;
+static bool PawnMoveOkB(const int from, const int to) {
+  const uint64_t both = Both();
+  if (PAWN_CHECKS_B[from] & Bit(to))
+    return Bit(to) & (White() | (BOARD->epsq > 0 ? Bit(BOARD->epsq) & 0x0000000000FF0000ULL : 0x0ULL));
+  if (to == from - 8)
+    return !(Bit(to) & both);
+  return to == from - 16 && Ycoord(from) == 6 && !((Bit(from - 8) | Bit(to)) & both);
+}
+
+static bool PieceMoveOk(const int piece, const int from, const int to) {
+  switch (piece) {
+  case 2:  return KNIGHT_MOVES[from] & Bit(to);
+  case 3:  return BishopMagicMoves(from, Both()) & Bit(to);
+  case 4:  return RookMagicMoves(from, Both()) & Bit(to);
+  case 5:  return (BishopMagicMoves(from, Both()) | RookMagicMoves(from, Both())) & Bit(to);
+  default: return KING_MOVES[from] & Bit(to);
+  }
 }
 
-static void MixScoreB(const int mg, const int eg) {
-  EVAL_POS_MG -= mg;
-  EVAL_POS_EG -= eg;
+// Pseudo legality of a hash move or a killer (From a different position)
+static bool MoveOkW(const uint16_t move) {
+  const int from = MoveFrom(move), to = MoveTo(move), type = MoveType(move), me = BOARD->board[from];
+  switch (type) {
+  case 1: return (BOARD->castle & 1) && from == KING_W && to == 6 && !(CASTLE_EMPTY_W[0] & Both()) && !ChecksCastleB(CASTLE_W[0]);
+  case 2: return (BOARD->castle & 2) && from == KING_W && to == 2 && !(CASTLE_EMPTY_W[1] & Both()) && !ChecksCastleB(CASTLE_W[1]);
+  case 3: case 4: return false;
+  }
+  if (type > 8 || me <= 0 || BOARD->board[to] >= 1 || (type >= 5) != (me == 1 && Ycoord(from) == 6))
+    return false;
+  return me == 1 ? PawnMoveOkW(from, to) : PieceMoveOk(me, from, to);
 }
 
-static void ScoreW(const int score, const int mg, const int eg) {
-  MixScoreW(mg * score, eg * score);
+static bool MoveOkB(const uint16_t move) {
+  const int from = MoveFrom(move), to = MoveTo(move), type = MoveType(move), me = BOARD->board[from];
+  switch (type) {
+  case 3: return (BOARD->castle & 4) && from == KING_B && to == 56 + 6 && !(CASTLE_EMPTY_B[0] & Both()) && !ChecksCastleW(CASTLE_B[0]);
+  case 4: return (BOARD->castle & 8) && from == KING_B && to == 56 + 2 && !(CASTLE_EMPTY_B[1] & Both()) && !ChecksCastleW(CASTLE_B[1]);
+  case 1: case 2: return false;
+  }
+  if (type > 8 || me >= 0 || BOARD->board[to] <= -1 || (type >= 5) != (me == -1 && Ycoord(from) == 1))
+    return false;
+  return me == -1 ? PawnMoveOkB(from, to) : PieceMoveOk(-me, from, to);
 }
 
-static void ScoreB(const int score, const int mg, const int eg) {
-  MixScoreB(mg * score, eg * score);
+static bool MoveLegalW(const uint16_t move) {
+  struct UNDO_T undo;
+  if (!MoveOkW(move))
+    return false;
+  MakeMoveW(move, &undo);
+  const bool checks = ChecksB();
+  UnmakeMoveW(move, &undo);
+  return !checks;
+}
+
+static bool MoveLegalB(const uint16_t move) {
+  struct UNDO_T undo;
+  if (!MoveOkB(move))
+    return false;
+  MakeMoveB(move, &undo);
+  const bool checks = ChecksW();
+  UnmakeMoveB(move, &undo);
+  return !checks;
+}
+
+// Tactics are searched in the tactical stage. Castling is always quiet
+static bool MoveTactical(const uint16_t move) {
+  const int from = MoveFrom(move), to = MoveTo(move), type = MoveType(move);
+  if (type)
+    return type >= 5;
+  if (BOARD->board[to])
+    return true;
+  switch (BOARD->board[from]) {
+  case +1: return to == BOARD->epsq || Ycoord(to) == 6;
+  case -1: return to == BOARD->epsq || Ycoord(to) == 1;
+  default: return false;
+  }
+}
+
+static bool PickerTried(const struct PICKER_T *const picker, const uint16_t move) {
+  for (int i = 0; i < picker->tried_n; i++)
+    if (picker->tried[i] == move)
+      return true;
+  return false;
+}
+
+static bool PickerTry(struct PICKER_T *const picker, const uint16_t move, const bool wtm) {
+  if (!move || PickerTried(picker, move) || !(wtm ? MoveLegalW(move) : MoveLegalB(move)))
+    return false;
+  picker->tried[picker->tried_n++] = move;
+  return true;
+}
+
+static void PickerSetup(struct PICKER_T *const picker, const uint16_t hash_move, const int ply, const bool checks) {
+  picker->stage     = PICK_HASH;
+  picker->tried_n   = picker->moves_n = picker->moves_i = 0;
+  picker->ply       = ply;
+  picker->checks    = checks;
+  picker->tactical  = false;
+  picker->hash_move = hash_move;
+}
+
+static uint16_t PickHash(struct PICKER_T *const picker, const bool wtm) {
+  return PickerTry(picker, picker->hash_move, wtm) ? picker->hash_move : 0;
+}
+
+static uint16_t PickKillers(struct PICKER_T *const picker, const bool wtm) {
+  for (int i = 0; i < 2; i++) {
+    const uint16_t killer = KILLERS[picker->ply][i];
+    if (!MoveTactical(killer) && PickerTry(picker, killer, wtm))
+      return killer;
+  }
+  return 0;
+}
+
+static uint16_t PickGenerated(struct PICKER_T *const picker, const bool sort) {
+  while (picker->moves_i < picker->moves_n) {
+    const struct MOVE_T *const next = sort ? SortNext(picker->moves, picker->moves_i, picker->moves_n) : picker->moves + picker->moves_i;
+    picker->moves_i++;
+    if (!PickerTried(picker, next->move)) {
+      picker->tactical = next->score != 0;
+      return next->move;
+    }
+  }
+  return 0;
+}
+
+// Yields legal moves lazily: Hash move -> Tactics -> Killers -> Quiets. 0 when done
+static uint16_t PickMove(struct PICKER_T *const picker, const bool wtm) {
+  uint16_t move = 0;
+  switch (picker->stage) {
+  case PICK_HASH:
+    picker->tactical = true;
+    if ((move = PickHash(picker, wtm)))
+      return move;
+    picker->stage = PICK_TACTICS_GEN;
+    // Fallthrough
+  case PICK_TACTICS_GEN: // Under checks all evasions at once
+    if (picker->checks)
+      picker->moves_n = wtm ? MgenEvasionsW(picker->moves) : MgenEvasionsB(picker->moves);
+    else
+      picker->moves_n = wtm ? MgenTacticsW(picker->moves) : MgenTacticsB(picker->moves);
+    picker->stage = PICK_TACTICS;
+    // Fallthrough
+  case PICK_TACTICS:
+    if ((move = PickGenerated(picker, true)))
+      return move;
+    if (picker->checks)
+      break;
+    picker->stage = PICK_KILLERS;
+    // Fallthrough
+  case PICK_KILLERS:
+    picker->tactical = false;
+    if ((move = PickKillers(picker, wtm)))
+      return move;
+    picker->stage = PICK_QUIETS_GEN;
+    // Fallthrough
+  case PICK_QUIETS_GEN:
+    picker->moves_n = wtm ? MgenQuietsW(picker->moves, picker->moves_n) : MgenQuietsB(picker->moves, picker->moves_n);
+    picker->stage   = PICK_QUIETS;
+    // Fallthrough
+  case PICK_QUIETS:
+    if ((move = PickGenerated(picker, false)))
+      return move;
+    break;
+  }
+  picker->stage = PICK_DONE;
+  return 0;
+}
+
+static void UpdateKillers(const int ply, const uint16_t move) {
+  if (KILLERS[ply][0] == move)
+    return;
+  KILLERS[ply][1] = KILLERS[ply][0];
+  KILLERS[ply][0] = move;
+}
+
+// Evaluation
+
+static int EvalClose(const int sq_a, const int sq_b) {
+  const int ret = 7 - Max(Abs(Xcoord(sq_a) - Xcoord(sq_b)), Abs(Ycoord(sq_a) - Ycoord(sq_b)));
+  return ret * ret;
 }
 
-static void MaterialW(const int piece) {
-  EVAL_MAT_MG += EVAL_PIECE_VALUE_MG[piece];
-  EVAL_MAT_EG += EVAL_PIECE_VALUE_EG[piece];
+static inline int ScoreMg(const int64_t score) {
+  return (int32_t) (uint32_t) (uint64_t) score;
 }
 
-static void MaterialB(const int piece) {
-  EVAL_MAT_MG -= EVAL_PIECE_VALUE_MG[piece];
-  EVAL_MAT_EG -= EVAL_PIECE_VALUE_EG[piece];
+static inline int ScoreEg(const int64_t score) {
+  return (int) ((score - ScoreMg(score)) / 0x100000000LL);
 }
 
-static void PsqtW(const int piece, const int index) {
-  MixScoreW(EVAL_PSQT_MG[piece][index], EVAL_PSQT_EG[piece][index]);
+static void MixScoreW(const int mg, const int eg) {
+  EVAL_SCORE += PACK(mg, eg);
 }
 
-static void PsqtB(const int piece, const int index) {
-  MixScoreB(EVAL_PSQT_MG_B[piece][index], EVAL_PSQT_EG_B[piece][index]);
+static void MixScoreB(const int mg, const int eg) {
+  EVAL_SCORE -= PACK(mg, eg);
+}
+
+static void ScoreW(const int score, const int mg, const int eg) {
+  EVAL_SCORE += score * PACK(mg, eg);
+}
+
+static void ScoreB(const int score, const int mg, const int eg) {
+  EVAL_SCORE -= score * PACK(mg, eg);
 }
 
 static void MobilityW(const uint64_t moves, const int mg, const int eg) {
@@ -1277,117 +2296,126 @@ static void AttacksB(const int me, uint64_t moves, const int mg, const int eg) {
   ScoreB(score, mg, eg);
 }
 
-static void EvalPawnsW(const int sq) {
-  MaterialW(0);
-  PsqtW(0, sq);
-  AttacksW(0, PAWN_CHECKS_W[sq], 2, 1);
+// Pawn only terms (Cached): Doubled, isolated and passed
+static void EvalPawnStructureW(const int sq) {
   ScoreW(PopCount(0xFFFFFFFFULL & EVAL_COLUMNS_UP[sq] & BOARD->white[0]), -35, -55);
   if (!(EVAL_FREE_COLUMNS[Xcoord(sq)] & BOARD->white[0]))
     MixScoreW(-55, 0);
-  if (PAWN_CHECKS_W[sq] & (BOARD->white[0] | BOARD->white[1] | BOARD->white[2]))
-    MixScoreW(55, 15);
   if (!(EVAL_COLUMNS_UP[sq] & (BOARD->black[0] | BOARD->white[0])))
     ScoreW(Ycoord(sq), 23, 57);
 }
 
-static void EvalPawnsB(const int sq) {
-  MaterialB(0);
-  PsqtB(0, sq);
-  AttacksB(0, PAWN_CHECKS_B[sq], 2, 1);
+static void EvalPawnStructureB(const int sq) {
   ScoreB(PopCount(0xFFFFFFFF00000000ULL & EVAL_COLUMNS_DOWN[sq] & BOARD->black[0]), -35, -55);
   if (!(EVAL_FREE_COLUMNS[Xcoord(sq)] & BOARD->black[0]))
     MixScoreB(-55, 0);
-  if (PAWN_CHECKS_B[sq] & (BOARD->black[0] | BOARD->black[1] | BOARD->black[2]))
-    MixScoreB(55, 15);
   if (!(EVAL_COLUMNS_DOWN[sq] & (BOARD->white[0] | BOARD->black[0])))
     ScoreB(7 - Ycoord(sq), 23, 57);
 }
 
+// Terms touching pieces, set-wise: Attacks and supporting pawns
+static void EvalPawnsW(void) {
+  const uint64_t pawns = BOARD->white[0], left = pawns & 0xFEFEFEFEFEFEFEFEULL, right = pawns & 0x7F7F7F7F7F7F7F7FULL,
+                 support = BOARD->white[0] | BOARD->white[1] | BOARD->white[2];
+  AttacksW(0, left << 7, 2, 1);
+  AttacksW(0, right << 9, 2, 1);
+  ScoreW(PopCount((left & (support >> 7)) | (right & (support >> 9))), 55, 15);
+}
+
+static void EvalPawnsB(void) {
+  const uint64_t pawns = BOARD->black[0], left = pawns & 0xFEFEFEFEFEFEFEFEULL, right = pawns & 0x7F7F7F7F7F7F7F7FULL,
+                 support = BOARD->black[0] | BOARD->black[1] | BOARD->black[2];
+  AttacksB(0, left >> 9, 2, 1);
+  AttacksB(0, right >> 7, 2, 1);
+  ScoreB(PopCount((left & (support << 9)) | (right & (support << 7))), 55, 15);
+}
+
+static void EvalPawnStructure(void) {
+  struct PAWN_HASH_T *const entry = &PAWN_HASH[(uint32_t) (BOARD->pawn_hash & PAWN_KEY)];
+  const struct PAWN_HASH_T cached = *entry;
+  STAT(pawn_probes);
+  if ((cached.lock ^ (uint64_t) cached.score) == BOARD->pawn_hash) {
+    STAT(pawn_hits);
+    EVAL_SCORE += cached.score;
+    return;
+  }
+  const int64_t before = EVAL_SCORE;
+  for (uint64_t pawns = BOARD->white[0]; pawns; pawns = ClearBit(pawns))
+    EvalPawnStructureW(Ctz(pawns));
+  for (uint64_t pawns = BOARD->black[0]; pawns; pawns = ClearBit(pawns))
+    EvalPawnStructureB(Ctz(pawns));
+  entry->score = EVAL_SCORE - before;
+  entry->lock  = BOARD->pawn_hash ^ (uint64_t) entry->score;
+}
+
 static void EvalKnightsW(const int sq) {
-  MaterialW(1);
-  PsqtW(1, sq);
   MobilityW(KNIGHT_MOVES[sq], 22, 18);
   AttacksW(1, KNIGHT_MOVES[sq] | Bit(sq), 2, 1);
 }
 
 static void EvalKnightsB(const int sq) {
-  MaterialB(1);
-  PsqtB(1, sq);
   MobilityB(KNIGHT_MOVES[sq], 22, 18);
   AttacksB(1, KNIGHT_MOVES[sq] | Bit(sq), 2, 1);
 }
 
 static void BonusBishopAndPawnsEg(const int me, const int bonus, const uint64_t own_pawns, const uint64_t enemy_pawns) {
   if (Bit(me) & 0x55AA55AA55AA55AAULL)
-    EVAL_POS_EG += bonus * PopCount(0x55AA55AA55AA55AAULL & own_pawns)
-                   + 2 * bonus * PopCount(0x55AA55AA55AA55AAULL & enemy_pawns);
+    MixScoreW(0, bonus * PopCount(0x55AA55AA55AA55AAULL & own_pawns)
+                 + 2 * bonus * PopCount(0x55AA55AA55AA55AAULL & enemy_pawns));
   else
-    EVAL_POS_EG += bonus * PopCount(0xAA55AA55AA55AA55ULL & own_pawns)
-                   + 2 * bonus * PopCount(0xAA55AA55AA55AA55ULL & enemy_pawns);
+    MixScoreW(0, bonus * PopCount(0xAA55AA55AA55AA55ULL & own_pawns)
+                 + 2 * bonus * PopCount(0xAA55AA55AA55AA55ULL & enemy_pawns));
 }
 
 static void EvalBishopsW(const int sq) {
-  MaterialW(2);
-  PsqtW(2, sq);
   MobilityW(BishopMagicMoves(sq, EVAL_BOTH), 29, 21);
   AttacksW(2, BISHOP_MOVES[sq] | Bit(sq), 5, 1);
   BonusBishopAndPawnsEg(sq, +30, BOARD->white[0], BOARD->black[0]);
 }
 
 static void EvalBishopsB(const int sq) {
-  MaterialB(2);
-  PsqtB(2, sq);
   MobilityB(BishopMagicMoves(sq, EVAL_BOTH), 29, 21);
   AttacksB(2, BISHOP_MOVES[sq] | Bit(sq), 5, 1);
   BonusBishopAndPawnsEg(sq, -30, BOARD->black[0], BOARD->white[0]);
 }
 
 static void EvalRooksW(const int sq) {
-  MaterialW(3);
-  PsqtW(3, sq);
   MobilityW(RookMagicMoves(sq, EVAL_BOTH), 21, 17);
   AttacksW(3, ROOK_MOVES[sq] | Bit(sq), 3, 2);
-  EVAL_POS_MG += 5 * PopCount(EVAL_COLUMNS_UP[sq] & EVAL_EMPTY);
+  ScoreW(PopCount(EVAL_COLUMNS_UP[sq] & EVAL_EMPTY), 5, 0);
   if (EVAL_COLUMNS_UP[sq] & (BOARD->white[3] | (BOARD->white[0] & 0xFFFFFFFF00000000ULL)))
-    EVAL_POS_MG += 50;
+    MixScoreW(50, 0);
   if (EVAL_COLUMNS_DOWN[sq] & BOARD->black[0] & 0x00000000FFFFFFFFULL)
-    EVAL_POS_EG += 30;
+    MixScoreW(0, 30);
 }
 
 static void EvalRooksB(const int sq) {
-  MaterialB(3);
-  PsqtB(3, sq);
   MobilityB(RookMagicMoves(sq, EVAL_BOTH), 21, 17);
   AttacksB(3, ROOK_MOVES[sq] | Bit(sq), 3, 2);
-  EVAL_POS_MG -= 5 * PopCount(EVAL_COLUMNS_DOWN[sq] & EVAL_EMPTY);
+  ScoreB(PopCount(EVAL_COLUMNS_DOWN[sq] & EVAL_EMPTY), 5, 0);
   if (EVAL_COLUMNS_DOWN[sq] & (BOARD->black[3] | (BOARD->black[0] & 0x00000000FFFFFFFFULL)))
-    EVAL_POS_MG -= 50;
+    MixScoreB(50, 0);
   if (EVAL_COLUMNS_UP[sq] & BOARD->white[0] & 0xFFFFFFFF00000000ULL)
-    EVAL_POS_EG -= 30;
+    MixScoreB(0, 30);
 }
 
 static void EvalQueensW(const int sq) {
-  MaterialW(4);
-  PsqtW(4, sq);
   MobilityW(BishopMagicMoves(sq, EVAL_BOTH) | RookMagicMoves(sq, EVAL_BOTH), 7, 21);
   AttacksW(4, QUEEN_MOVES[sq] | Bit(sq), 1, 3);
 }
 
 static void EvalQueensB(const int sq) {
-  MaterialB(4);
-  PsqtB(4, sq);
   MobilityB(BishopMagicMoves(sq, EVAL_BOTH) | RookMagicMoves(sq, EVAL_BOTH), 7, 21);
   AttacksB(4, QUEEN_MOVES[sq] | Bit(sq), 1, 3);
 }
 
 static void BonusKingShield(const int sq, const int color, const bool own_shield) {
-  if (own_shield)                                EVAL_POS_MG += 42 * color;
-  if (BOARD->board[sq + 8 * color] == 1 * color) EVAL_POS_MG += 100 * color;
-  if (BOARD->board[sq + 8 * color] == 3 * color) EVAL_POS_MG += 50 * color;
+  if (own_shield)                                MixScoreW(42 * color, 0);
+  if (BOARD->board[sq + 8 * color] == 1 * color) MixScoreW(100 * color, 0);
+  if (BOARD->board[sq + 8 * color] == 3 * color) MixScoreW(50 * color, 0);
 }
 
 static void EvalKingsW(const int sq) {
-  PsqtW(5, sq);
   MobilityW(KING_MOVES[sq], 7, 35);
   AttacksW(5, KING_MOVES[sq] | Bit(sq), 0, 5);
   ScoreW(PopCount(EVAL_KING_RING[sq] & EVAL_BLACK), -200, 5);
@@ -1404,7 +2432,6 @@ static void EvalKingsW(const int sq) {
 }
 
 static void EvalKingsB(const int sq) {
-  PsqtB(5, sq);
   MobilityB(KING_MOVES[sq], 7, 35);
   AttacksB(5, KING_MOVES[sq] | Bit(sq), 0, 5);
   ScoreB(PopCount(EVAL_KING_RING[sq] & EVAL_WHITE), -200, 5);
@@ -1430,9 +2457,13 @@ static void MatingB(void) {
   ScoreB(EvalClose(EVAL_BLACK_KING_SQ, EVAL_WHITE_KING_SQ), 17, 17);
 }
 
+// Material and PSQT come incrementally from the board. Debug builds verify them
 static void EvalSetup(void) {
-  EVAL_POS_MG = EVAL_POS_EG = EVAL_MAT_MG = EVAL_MAT_EG = 0;
-  EVAL_DRAWISH_FACTOR = 1.0f;
+#ifndef NDEBUG
+  Assert(BOARD->score == MaterialFull(), "Error #8: Bad material !");
+#endif
+  EVAL_SCORE          = BOARD->score;
+  EVAL_DRAWISH        = 100;
   EVAL_WHITE_KING_SQ  = Ctz(BOARD->white[5]);
   EVAL_BLACK_KING_SQ  = Ctz(BOARD->black[5]);
   EVAL_WHITE          = White();
@@ -1442,12 +2473,14 @@ static void EvalSetup(void) {
   EVAL_BOTH_N         = PopCount(EVAL_BOTH);
 }
 
-static float EvalCalculateScale(const bool wtm) {
-  float scale = (EVAL_BOTH_N - 2.0f) * (1.0f / ((2.0f * 16.0f) - 2.0f));
-  scale = 0.5f * (1.0f + (scale > 1.0f ? 1.0f : scale));
-  if (wtm)
-    return scale * scale * (BOARD->black[4] ? 1.0f : 0.9f);
-  return scale * scale * (BOARD->white[4] ? 1.0f : 0.9f);
+// Middlegame weight: 0 (Endgame) .. 1024 (Middlegame)
+static int EvalPhase(const bool wtm, const int both_n) {
+  const int x = 30 + Min(30, both_n - 2), phase = (1024 * x * x) / 3600;
+  return (wtm ? BOARD->black[4] : BOARD->white[4]) ? phase : (9 * phase) / 10;
+}
+
+static int EvalTaper(const int64_t score, const int phase) {
+  return (int) ((82 * (((int64_t) phase) * ScoreMg(score) + ((int64_t) (1024 - phase)) * ScoreEg(score))) / (100 * 1024));
 }
 
 static void EvalBonusPair(const int piece, const int mg, const int eg) {
@@ -1463,20 +2496,21 @@ static void EvalEndgame(void) {
   else if (PopCount(EVAL_WHITE) == 1)
     MatingB();
   else if (!(BOARD->white[0] | BOARD->black[0]))
-    EVAL_DRAWISH_FACTOR = 0.95f;
+    EVAL_DRAWISH = 95;
 }
 
 static void EvalPieces(void) {
-  for (uint64_t both = EVAL_BOTH; both; both = ClearBit(both)) {
+  EvalPawnStructure();
+  EvalPawnsW();
+  EvalPawnsB();
+  for (uint64_t both = EVAL_BOTH & ~(BOARD->white[0] | BOARD->black[0]); both; both = ClearBit(both)) {
     const int sq = Ctz(both);
     switch (BOARD->board[sq]) {
-    case +1: EvalPawnsW(sq);   break;
     case +2: EvalKnightsW(sq); break;
     case +3: EvalBishopsW(sq); break;
     case +4: EvalRooksW(sq);   break;
     case +5: EvalQueensW(sq);  break;
     case +6: EvalKingsW(sq);   break;
-    case -1: EvalPawnsB(sq);   break;
     case -2: EvalKnightsB(sq); break;
     case -3: EvalBishopsB(sq); break;
     case -4: EvalRooksB(sq);   break;
@@ -1487,9 +2521,7 @@ static void EvalPieces(void) {
 }
 
 static int EvalCalculateScore(const bool wtm) {
-  const float scale = EvalCalculateScale(wtm);
-  return (int) ((scale         * (0.82f * (float) (EVAL_POS_MG + EVAL_MAT_MG)))   // Middlegame
-             + ((1.0f - scale) * (0.82f * (float) (EVAL_POS_EG + EVAL_MAT_EG)))); // Endgame
+  return (EVAL_DRAWISH * EvalTaper(EVAL_SCORE, EvalPhase(wtm, EVAL_BOTH_N))) / 100;
 }
 
 static int EvalAll(const bool wtm) {
@@ -1503,23 +2535,194 @@ static int EvalAll(const bool wtm) {
   return EvalCalculateScore(wtm);
 }
 
-static bool DrawMaterial(void) {
-  if (BOARD->white[0] | BOARD->black[0] | BOARD->white[3] | BOARD->black[3] | BOARD->white[4] | BOARD->black[4])
-    return false;
-  return PopCount(BOARD->white[1] | BOARD->white[2]) <= 1 && PopCount(BOARD->black[1] | BOARD->black[2]) <= 1;
+static bool DrawMaterial(void) {
+  if (BOARD->white[0] | BOARD->black[0] | BOARD->white[3] | BOARD->black[3] | BOARD->white[4] | BOARD->black[4])
+    return false;
+  return PopCount(BOARD->white[1] | BOARD->white[2]) <= 1 && PopCount(BOARD->black[1] | BOARD->black[2]) <= 1;
+}
+
+// Material + PSQT estimate from the incremental board sums
+static int EvalFast(const bool wtm) {
+  const int score = EvalTaper(BOARD->score, EvalPhase(wtm, PopCount(Both())));
+  return (SCALE[BOARD->rule50] * (score + (wtm ? +5 : -5))) / 100;
+}
+
+static inline bool EvalChildOk(const uint16_t move) {
+  return BOARD->board[MoveTo(move)] && !MoveType(move);
+}
+
+static inline int EvalChildFast(const uint16_t move, const int phase, const int tempo) {
+  const int from = MoveFrom(move), to = MoveTo(move), me = BOARD->board[from] + 6;
+  const int64_t score = BOARD->score + EVAL_PIECE_SQ[me][to] - EVAL_PIECE_SQ[me][from] - EVAL_PIECE_SQ[BOARD->board[to] + 6][to];
+  return EvalTaper(score, phase) + tempo;
+}
+
+// Batched EvalFast() of capture children without making them. Promotions, en passant and non-captures get +-INF
+// Children have one piece less and rule50 = 0. Their side to move is !wtm
+// With <= 4 pieces left a child may be DrawMaterial(), so none is estimated
+static void EvalChildren(const struct MOVE_T *const moves, const int moves_n, const bool wtm, int *const fast) {
+  const int pieces = PopCount(Both()) - 1, phase = EvalPhase(!wtm, pieces), tempo = wtm ? -5 : +5, never = wtm ? INF : -INF;
+  for (int i = 0; i < moves_n; i++)
+    fast[i] = pieces > 4 && EvalChildOk(moves[i].move) ? EvalChildFast(moves[i].move, phase, tempo) : never;
+}
+
+static int Eval(const bool wtm) {
+  if (DrawMaterial())
+    return 0;
+  const uint64_t hash = Hash(wtm);
+  struct EVAL_HASH_T *const entry = &EVAL_HASH[(uint32_t) (hash & EVAL_KEY)];
+  const struct EVAL_HASH_T cached = *entry;
+  STAT(eval_probes);
+  if ((cached.lock ^ (uint32_t) cached.score) == hash) {
+    STAT(eval_hits);
+    return cached.score;
+  }
+  const int noise = LEVEL == 100 ? 0 : 10 * Random(LEVEL - 100, 100 - LEVEL);
+  const int score = (NNUE_ON ? NnueEval(wtm) : EvalAll(wtm)) + (wtm ? +5 : -5);
+  entry->score = score;
+  entry->lock  = hash ^ (uint32_t) score;
+  return (SCALE[BOARD->rule50] * score) / 100 + noise;
+}
+
+// LAZY_MARGIN is tuned for EvalAll(). NNUE scores are never replaced by the estimate
+static int LazyMargin(void) {
+  return NNUE_ON ? 0 : 10 * LAZY_MARGIN;
+}
+
+// Full eval only when the estimate is within LAZY_MARGIN (cp) of the window
+static int EvalLazy(const bool wtm, const int alpha, const int beta) {
+  const int margin = LazyMargin();
+  if (!margin || DrawMaterial())
+    return Eval(wtm);
+  const int fast = EvalFast(wtm);
+  STAT(lazy_probes);
+  if (fast + margin <= alpha || fast - margin >= beta) {
+    STAT(lazy_hits);
+    return fast;
+  }
+  return Eval(wtm);
+}
+
+// Transposition table
+
+static void HashFree(void) {
+  if (!HASH)
+    return;
+#ifdef WINDOWS
+  free(HASH);
+#else
+  munmap(HASH, HASH_BYTES);
+#endif
+  HASH = 0;
+}
+
+// Explicit huge pages, then transparent huge pages, then plain pages. Fresh memory is zeroed
+static struct HASH_T *HashAlloc(const uint64_t bytes) {
+#ifdef WINDOWS
+  HASH_HUGE = false;
+  return (struct HASH_T *) calloc(1, bytes);
+#else
+  void *mem;
+  HASH_HUGE = true;
+#ifdef MAP_HUGETLB
+  // munmap() of HASH_BYTES needs whole 2 MB pages, so 1 MB stays on plain pages
+  if (!(bytes % (2 << 20))) {
+#ifdef MAP_HUGE_SHIFT
+    mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+#else
+    mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (mem != MAP_FAILED)
+      return (struct HASH_T *) mem;
+  }
+#endif
+  mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+#ifdef MADV_HUGEPAGE
+  HASH_HUGE = !madvise(mem, bytes, MADV_HUGEPAGE);
+#else
+  HASH_HUGE = false;
+#endif
+  return (struct HASH_T *) mem;
+#endif
+}
+
+static void HashInfo(void) {
+  Print("info string Hash %i MB%s", HASH_SIZE_MB, HASH_HUGE ? " (huge pages)" : "");
+}
+
+// Rounded down to a power of 2
+static void HashResize(const int mb) {
+  int size_mb = 1;
+  while (2 * size_mb <= mb)
+    size_mb *= 2;
+  if (HASH && size_mb == HASH_SIZE_MB)
+    return;
+  HashFree();
+  HASH_SIZE_MB = size_mb;
+  HASH_BYTES   = ((uint64_t) size_mb) << 20;
+  HASH_KEY     = HASH_BYTES / (4 * sizeof(struct HASH_T)) - 1;
+  HASH         = HashAlloc(HASH_BYTES);
+  Assert(HASH != NULL, "Error #6: Out of memory !");
+}
+
+static void HashClear(void) {
+  memset(HASH, 0, HASH_BYTES);
+  HASH_AGE = 0;
+}
+
+static int HashWorth(const struct HASH_T *const entry) {
+  return entry->depth - 8 * ((HASH_AGE - (entry->flags >> 2)) & 0x3F);
+}
+
+// Entries are copied out and verified, since other threads may be writing them
+static bool HashProbe(const uint64_t hash, struct HASH_T *const entry) {
+  const struct HASH_T *const cluster = &HASH[4 * (hash & HASH_KEY)];
+  for (int i = 0; i < 4; i++) {
+    *entry = cluster[i];
+    if ((entry->lock ^ entry->data) == hash)
+      return true;
+  }
+  return false;
+}
+
+static bool HashCutoff(const struct HASH_T *const entry, const int alpha, const int beta) {
+  switch (entry->flags & 0x3) {
+  case EXACT: return true;
+  case LOWER: return entry->score >= beta;
+  case UPPER: return entry->score <= alpha;
+  default:    return false;
+  }
 }
 
-static int Eval(const bool wtm) {
-  if (DrawMaterial())
-    return 0;
-  const uint64_t hash = Hash(wtm);
-  struct HASH_T *const entry = &HASH[(uint32_t) (hash & HASH_KEY)];
-  if (entry->eval_hash == hash)
-    return entry->score;
-  const int noise = LEVEL == 100 ? 0 : 10 * Random(LEVEL - 100, 100 - LEVEL);
-  entry->eval_hash = hash;
-  entry->score = ((int) (EVAL_DRAWISH_FACTOR * EvalAll(wtm))) + (wtm ? +5 : -5);
-  return ((int) (SCALE[BOARD->rule50] * (float) entry->score)) + noise;
+// Same key or the least worthy (Shallow or old) entry of the cluster is replaced
+static void HashStore(const uint64_t hash, const int score, uint16_t move, const int depth, const enum BOUND_T bound) {
+  if (STOP_SEARCH)
+    return;
+  struct HASH_T *const cluster = &HASH[4 * (hash & HASH_KEY)], *entry = cluster, old = {0, {{0,0,0,0}}};
+  for (int i = 0; i < 4; i++) {
+    old = cluster[i];
+    if ((old.lock ^ old.data) == hash) {
+      entry = cluster + i;
+      break;
+    }
+    if (HashWorth(cluster + i) < HashWorth(entry))
+      entry = cluster + i;
+  }
+  if ((old.lock ^ old.data) == hash) {
+    if (bound != EXACT && depth < old.depth - 2)
+      return;
+    if (!move)
+      move = old.move;
+  }
+  struct HASH_T tmp;
+  tmp.score   = score;
+  tmp.move    = move;
+  tmp.depth   = depth;
+  tmp.flags   = bound | (HASH_AGE << 2);
+  entry->data = tmp.data;
+  entry->lock = hash ^ tmp.data;
 }
 
 // Search
@@ -1534,60 +2737,89 @@ static bool Draw(void) {
   return DrawMaterial();
 }
 
-static void Speak(const int score, const uint64_t search_time) {
-  Print("info depth %i nodes %llu time %llu nps %llu score cp %i pv %s",
-        Min(MAX_DEPTH, DEPTH + 1),
-        NODES, search_time,
-        Nps(NODES, search_time),
-        (WTM ? +1 : -1) * ((int) ((Abs(score) >= INF ? 0.01f : 0.1f) * score)),
-        MoveName(&ROOT_MOVES[0]));
+static uint64_t NodesAll(void) {
+  uint64_t nodes = NODES;
+  for (int i = 1; i < THREADS_N; i++)
+    nodes += atomic_load_explicit(&THREADS[i].nodes, memory_order_relaxed);
+  return nodes;
 }
 
-#ifdef WINDOWS
-static bool InputAvailable(void) {
-  return _kbhit();
+static int SpeakScore(const int score) {
+  return (WTM ? +1 : -1) * ((int) ((Abs(score) >= INF ? 0.01f : 0.1f) * score));
 }
-#else
-static bool InputAvailable(void) {
-  fd_set fd;
-  struct timeval tv;
-  FD_ZERO(&fd);
-  FD_SET(STDIN_FILENO, &fd);
-  tv.tv_sec = tv.tv_usec = 0;
-  select(STDIN_FILENO + 1, &fd, 0, 0, &tv);
-  return FD_ISSET(STDIN_FILENO, &fd) > 0;
+
+// MultiPV: One line per scored root move. Root move scores are from the side to move
+static void Speak(const int score, const uint64_t search_time, const int lines) {
+  if (SILENT)
+    return;
+  const uint64_t nodes = NodesAll();
+  if (lines <= 1) {
+    Print("info depth %i nodes %llu time %llu nps %llu score cp %i pv %s",
+          Min(MAX_DEPTH, DEPTH + 1),
+          nodes, search_time,
+          Nps(nodes, search_time),
+          SpeakScore(score),
+          MoveName(ROOT_MOVES[0].move));
+    return;
+  }
+  for (int i = 0; i < lines; i++)
+    Print("info depth %i multipv %i nodes %llu time %llu nps %llu score cp %i pv %s",
+          Min(MAX_DEPTH, DEPTH + 1), i + 1,
+          nodes, search_time,
+          Nps(nodes, search_time),
+          SpeakScore(WTM ? ROOT_MOVES[i].score : -ROOT_MOVES[i].score),
+          MoveName(ROOT_MOVES[i].move));
 }
-#endif
 
+// "stop" ends the command read last before it (And any older one). Later commands are not affected
 static bool UserStop(void) {
-  if (!ANALYZING || !InputAvailable())
-    return false;
-  Input();
-  return Token("stop");
+  return USER_STOP && USER_STOP >= INPUT_SEQ;
 }
 
 static bool TimeCheckSearch(void) {
   static uint64_t ticks = 0;
-  if (++ticks & 0xFFULL)
+  if (THREAD_ID) { // Helpers only publish their node count
+    if (!(NODES & 0xFFULL))
+      atomic_store_explicit(&THREADS[THREAD_ID].nodes, NODES, memory_order_relaxed);
     return STOP_SEARCH;
-  if ((Now() >= STOP_SEARCH_TIME) || UserStop())
+  }
+  if (++ticks & 0xFFULL) // Main thread only
+    return STOP_SEARCH;
+  if (PONDERING && PONDER_HIT) { // Same search, now on the clock
+    PONDERING        = false;
+    TM_START         = NowCoarse();
+    STOP_SEARCH_TIME = TM_START + (uint64_t) HARD_TIME;
+  }
+  if (UserStop() || (!PONDERING && NowCoarse() >= STOP_SEARCH_TIME) || (MAX_NODES && NODES >= MAX_NODES))
     return STOP_SEARCH = true;
   return STOP_SEARCH;
 }
 
 static int QSearchW(int alpha, const int beta, const int depth) {
   NODES++;
+  STAT(qnodes);
   if (TimeCheckSearch())
     return 0;
-  alpha = Max(alpha, Eval(true));
+  alpha = Max(alpha, EvalLazy(true, alpha, beta));
   if (depth <= 0 || alpha >= beta)
     return alpha;
-  struct BOARD_T moves[64];
-  const int moves_n = MgenTacticalW(moves);
+  struct MOVE_T moves[64];
+  struct UNDO_T undo;
+  int fast[64];
+  const int moves_n = MgenTacticalW(moves), margin = LazyMargin();
   SortAll();
+  if (margin)
+    EvalChildren(moves, moves_n, true, fast);
   for (int i = 0; i < moves_n; i++) {
-    BOARD = moves + i;
-    if ((alpha = Max(alpha, QSearchB(alpha, beta, depth - 1))) >= beta)
+    if (margin && fast[i] + margin <= alpha) { // Child would stand pat lazily below alpha
+      STAT(lazy_probes);
+      STAT(lazy_hits);
+      continue;
+    }
+    MakeMoveW(moves[i].move, &undo);
+    alpha = Max(alpha, QSearchB(alpha, beta, depth - 1));
+    UnmakeMoveW(moves[i].move, &undo);
+    if (alpha >= beta)
       return alpha;
   }
   return alpha;
@@ -1595,61 +2827,85 @@ static int QSearchW(int alpha, const int beta, const int depth) {
 
 static int QSearchB(const int alpha, int beta, const int depth) {
   NODES++;
+  STAT(qnodes);
   if (STOP_SEARCH)
     return 0;
-  beta = Min(beta, Eval(false));
+  beta = Min(beta, EvalLazy(false, alpha, beta));
   if (depth <= 0 || alpha >= beta)
     return beta;
-  struct BOARD_T moves[64];
-  const int moves_n = MgenTacticalB(moves);
+  struct MOVE_T moves[64];
+  struct UNDO_T undo;
+  int fast[64];
+  const int moves_n = MgenTacticalB(moves), margin = LazyMargin();
   SortAll();
+  if (margin)
+    EvalChildren(moves, moves_n, false, fast);
   for (int i = 0; i < moves_n; i++) {
-    BOARD = moves + i;
-    if (alpha >= (beta = Min(beta, QSearchW(alpha, beta, depth - 1))))
+    if (margin && fast[i] - margin >= beta) {
+      STAT(lazy_probes);
+      STAT(lazy_hits);
+      continue;
+    }
+    MakeMoveB(moves[i].move, &undo);
+    beta = Min(beta, QSearchW(alpha, beta, depth - 1));
+    UnmakeMoveB(moves[i].move, &undo);
+    if (alpha >= beta)
       return beta;
   }
   return beta;
 }
 
-static void UpdateSort(struct HASH_T *const entry, const enum MOVE_T type, const uint64_t hash, const uint8_t index) {
-  entry->sort_hash = hash;
-  switch (type) {
-  case KILLER: entry->killer = index + 1; break;
-  case GOOD:   entry->good   = index + 1; break;
-  case QUIET:  entry->quiet  = index + 1; break;
-  }
-}
-
-static int SearchMovesW(int alpha, const int beta, int depth, const int ply) {
+static int SearchMovesW(int alpha, const int beta, const int depth, const int ply) {
   const uint64_t hash = REPETITION_POSITIONS[BOARD->rule50];
-  struct BOARD_T moves[MAX_MOVES];
+  struct HASH_T entry;
+  const bool hit = HashProbe(hash, &entry);
+  STAT(nodes);
+  STAT(hash_probes);
+  if (hit) {
+    STAT(hash_hits);
+    if (entry.move)
+      STAT(hash_moves);
+  }
+  if (hit && entry.depth >= depth && HashCutoff(&entry, alpha, beta))
+    return entry.score;
   const bool checks = ChecksB();
-  const int moves_n = MgenW(moves);
-  if (!moves_n)
-    return checks ? -INF : 0;
-  if (ply < 5 && (moves_n == 1 || checks))
-    depth++;
-  bool ok_lmr = moves_n >= 5 && depth >= 2 && !checks;
-  struct HASH_T *const entry = &HASH[(uint32_t) (hash & HASH_KEY)];
-  SortByHash(entry, hash);
-  for (int i = 0; i < moves_n; i++) {
-    BOARD = moves + i;
-    if (ok_lmr && i >= 2 && !BOARD->score && !ChecksW()) { // LMR
-      if (SearchB(alpha, beta, depth - 2 - Min(1, i / 23), ply + 1) <= alpha)
+  const int alpha_orig = alpha, new_depth = ply < 5 && checks ? depth + 1 : depth;
+  struct PICKER_T picker;
+  struct UNDO_T undo;
+  bool ok_lmr = new_depth >= 2 && !checks;
+  uint16_t best_move = 0;
+  int i = 0;
+  PickerSetup(&picker, hit ? entry.move : 0, ply, checks);
+  for (uint16_t move; (move = PickMove(&picker, true)); i++) {
+    MakeMoveW(move, &undo);
+    if (ok_lmr && i >= 2 && !picker.tactical && !ChecksW()) { // LMR
+      STAT(lmr);
+      if (SearchB(alpha, beta, new_depth - 2 - Min(1, i / 23), ply + 1) <= alpha) {
+        UnmakeMoveW(move, &undo);
         continue;
-      BOARD = moves + i;
+      }
+      STAT(lmr_researches);
     }
-    const int score = SearchB(alpha, beta, depth - 1, ply + 1);
+    const int score = SearchB(alpha, beta, new_depth - 1, ply + 1);
+    UnmakeMoveW(move, &undo);
     if (score > alpha) {
-      alpha  = score;
-      ok_lmr = false;
+      alpha     = score;
+      best_move = move;
+      ok_lmr    = false;
       if (alpha >= beta) {
-        UpdateSort(entry, KILLER, hash, moves[i].index);
+        STAT(cutoffs[Min(i, 7)]);
+        if (hit && move == entry.move)
+          STAT(hash_move_cutoffs);
+        HashStore(hash, alpha, move, depth, LOWER);
+        if (picker.stage >= PICK_KILLERS)
+          UpdateKillers(ply, move);
         return alpha;
       }
-      UpdateSort(entry, moves[i].score ? GOOD : QUIET, hash, moves[i].index);
     }
   }
+  if (!i)
+    return checks ? -INF : 0;
+  HashStore(hash, alpha, best_move, depth, alpha > alpha_orig ? EXACT : UPPER);
   return alpha;
 }
 
@@ -1667,36 +2923,57 @@ static int SearchW(int alpha, const int beta, const int depth, const int ply) {
   return alpha;
 }
 
-static int SearchMovesB(const int alpha, int beta, int depth, const int ply) {
+static int SearchMovesB(const int alpha, int beta, const int depth, const int ply) {
   const uint64_t hash = REPETITION_POSITIONS[BOARD->rule50];
-  struct BOARD_T moves[MAX_MOVES];
+  struct HASH_T entry;
+  const bool hit = HashProbe(hash, &entry);
+  STAT(nodes);
+  STAT(hash_probes);
+  if (hit) {
+    STAT(hash_hits);
+    if (entry.move)
+      STAT(hash_moves);
+  }
+  if (hit && entry.depth >= depth && HashCutoff(&entry, alpha, beta))
+    return entry.score;
   const bool checks = ChecksW();
-  const int moves_n = MgenB(moves);
-  if (!moves_n)
-    return checks ? INF : 0;
-  if (ply < 5 && (moves_n == 1 || checks))
-    depth++;
-  bool ok_lmr = moves_n >= 5 && depth >= 2 && !checks;
-  struct HASH_T *const entry = &HASH[(uint32_t) (hash & HASH_KEY)];
-  SortByHash(entry, hash);
-  for (int i = 0; i < moves_n; i++) {
-    BOARD = moves + i;
-    if (ok_lmr && i >= 2 && !BOARD->score && !ChecksB()) {
-      if (SearchW(alpha, beta, depth - 2 - Min(1, i / 23), ply + 1) >= beta)
+  const int beta_orig = beta, new_depth = ply < 5 && checks ? depth + 1 : depth;
+  struct PICKER_T picker;
+  struct UNDO_T undo;
+  bool ok_lmr = new_depth >= 2 && !checks;
+  uint16_t best_move = 0;
+  int i = 0;
+  PickerSetup(&picker, hit ? entry.move : 0, ply, checks);
+  for (uint16_t move; (move = PickMove(&picker, false)); i++) {
+    MakeMoveB(move, &undo);
+    if (ok_lmr && i >= 2 && !picker.tactical && !ChecksB()) {
+      STAT(lmr);
+      if (SearchW(alpha, beta, new_depth - 2 - Min(1, i / 23), ply + 1) >= beta) {
+        UnmakeMoveB(move, &undo);
         continue;
-      BOARD = moves + i;
+      }
+      STAT(lmr_researches);
     }
-    const int score = SearchW(alpha, beta, depth - 1, ply + 1);
+    const int score = SearchW(alpha, beta, new_depth - 1, ply + 1);
+    UnmakeMoveB(move, &undo);
     if (score < beta) {
-      beta   = score;
-      ok_lmr = false;
+      beta      = score;
+      best_move = move;
+      ok_lmr    = false;
       if (alpha >= beta) {
-        UpdateSort(entry, KILLER, hash, moves[i].index);
+        STAT(cutoffs[Min(i, 7)]);
+        if (hit && move == entry.move)
+          STAT(hash_move_cutoffs);
+        HashStore(hash, beta, move, depth, UPPER);
+        if (picker.stage >= PICK_KILLERS)
+          UpdateKillers(ply, move);
         return beta;
       }
-      UpdateSort(entry, moves[i].score ? GOOD : QUIET, hash, moves[i].index);
     }
   }
+  if (!i)
+    return checks ? INF : 0;
+  HashStore(hash, beta, best_move, depth, beta < beta_orig ? EXACT : LOWER);
   return beta;
 }
 
@@ -1714,19 +2991,66 @@ static int SearchB(const int alpha, int beta, const int depth, const int ply) {
   return beta;
 }
 
+// MultiPV: The first MULTIPV moves get full windows. Later ones must beat the worst of them
+static int BestMultiW(void) {
+  const int pvs = Min(MULTIPV, ROOT_MOVES_N);
+  struct UNDO_T undo;
+  for (int i = 0; i < ROOT_MOVES_N; i++) {
+    const int alpha = i < pvs ? -INF : ROOT_MOVES[pvs - 1].score;
+    int score = 0;
+    MakeMoveW(ROOT_MOVES[i].move, &undo);
+    if (i >= pvs) {
+      if ((score = SearchB(alpha, alpha + 1, DEPTH, 0)) > alpha)
+        score = SearchB(alpha, INF, DEPTH, 0);
+    } else {
+      score = SearchB(-INF, INF, DEPTH, 0);
+    }
+    UnmakeMoveW(ROOT_MOVES[i].move, &undo);
+    if (STOP_SEARCH)
+      return BEST_SCORE;
+    ROOT_MOVES[i].score = score;
+    SortRootScore(i);
+  }
+  return ROOT_MOVES[0].score;
+}
+
+static int BestMultiB(void) {
+  const int pvs = Min(MULTIPV, ROOT_MOVES_N);
+  struct UNDO_T undo;
+  for (int i = 0; i < ROOT_MOVES_N; i++) {
+    const int beta = i < pvs ? INF : -ROOT_MOVES[pvs - 1].score;
+    int score = 0;
+    MakeMoveB(ROOT_MOVES[i].move, &undo);
+    if (i >= pvs) {
+      if ((score = SearchW(beta - 1, beta, DEPTH, 0)) < beta)
+        score = SearchW(-INF, beta, DEPTH, 0);
+    } else {
+      score = SearchW(-INF, INF, DEPTH, 0);
+    }
+    UnmakeMoveB(ROOT_MOVES[i].move, &undo);
+    if (STOP_SEARCH)
+      return BEST_SCORE;
+    ROOT_MOVES[i].score = -score;
+    SortRootScore(i);
+  }
+  return -ROOT_MOVES[0].score;
+}
+
 static int BestW(void) {
+  if (MULTIPV > 1)
+    return BestMultiW();
   int score = 0, best_i = 0, alpha = -INF;
+  struct UNDO_T undo;
   for (int i = 0; i < ROOT_MOVES_N; i++) {
-    BOARD = ROOT_MOVES + i;
+    MakeMoveW(ROOT_MOVES[i].move, &undo);
     // First stable score for alpha ! -> Smaller window search ! -> Unstable ? -> Research !
     if (DEPTH >= 1 && i >= 1) {
-      if ((score = SearchB(alpha, alpha + 1, DEPTH, 0)) > alpha) {
-        BOARD = ROOT_MOVES + i;
+      if ((score = SearchB(alpha, alpha + 1, DEPTH, 0)) > alpha)
         score = SearchB(alpha, INF, DEPTH, 0);
-      }
     } else {
       score = SearchB(alpha, INF, DEPTH, 0);
     }
+    UnmakeMoveW(ROOT_MOVES[i].move, &undo);
     if (STOP_SEARCH)
       return BEST_SCORE;
     if (score > alpha) {
@@ -1739,17 +3063,19 @@ static int BestW(void) {
 }
 
 static int BestB(void) {
+  if (MULTIPV > 1)
+    return BestMultiB();
   int score = 0, best_i = 0, beta = INF;
+  struct UNDO_T undo;
   for (int i = 0; i < ROOT_MOVES_N; i++) {
-    BOARD = ROOT_MOVES + i;
+    MakeMoveB(ROOT_MOVES[i].move, &undo);
     if (DEPTH >= 1 && i >= 1) {
-      if ((score = SearchW(beta - 1, beta, DEPTH, 0)) < beta) {
-        BOARD = ROOT_MOVES + i;
+      if ((score = SearchW(beta - 1, beta, DEPTH, 0)) < beta)
         score = SearchW(-INF, beta, DEPTH, 0);
-      }
     } else {
       score = SearchW(-INF, beta, DEPTH, 0);
     }
+    UnmakeMoveB(ROOT_MOVES[i].move, &undo);
     if (STOP_SEARCH)
       return BEST_SCORE;
     if (score < beta) {
@@ -1761,11 +3087,103 @@ static int BestB(void) {
   return beta;
 }
 
+// Time manager
+
+// Budgets (ms) for one move from the clock. Soft: No new iteration after it. Hard: The search stops
+static void TimeSetup(const int time, const int inc, const int mtg) {
+  TM_SOFT  = Max(1, Min(time / mtg + inc, time / 2));
+  TM_LIMIT = Max(TM_SOFT, time / 2);
+  TM_HARD  = Min(4 * TM_SOFT, TM_LIMIT);
+}
+
+// Percent. Unstable best move, falling score or many root moves: More time
+static int TimeScale(const int stable, const int drop) {
+  static const int stability[5] = {140, 115, 100, 85, 70};
+  const int swing = Between(-20, drop / 20, 60); // Half of the drop in cp
+  return stability[Min(stable, 4)] * (100 + swing) / 100 * (ROOT_MOVES_N < 4 ? 70 : 100) / 100;
+}
+
+// After each iteration: Scale both limits. True if the next iteration is not worth starting
+static bool TimeIteration(const int stable, const int drop) {
+  const int scale = TimeScale(stable, drop), soft = TM_SOFT * scale / 100;
+  HARD_TIME = Min(TM_HARD * scale / 100, TM_LIMIT);
+  if (!PONDERING)
+    STOP_SEARCH_TIME = TM_START + (uint64_t) HARD_TIME;
+  return !PONDERING && NowCoarse() - TM_START >= (uint64_t) soft;
+}
+
+static void TimeSpeak(const char *const reason, const int stable, const int drop) {
+  Print("info string Time %s used %llu soft %i hard %i scale %i stable %i drop %i",
+        reason, NowCoarse() - TM_START, TM_SOFT, HARD_TIME, TimeScale(stable, drop), stable, drop / 10);
+}
+
+// Lazy SMP
+
+// Helpers search the same root with staggered depths. They only talk through the hash
+static void *HelperThink(void *const arg) {
+  struct THREAD_T *const thread = (struct THREAD_T *) arg;
+  THREAD_ID    = thread->id;
+  BOARD_TMP    = thread->board;
+  BOARD        = &BOARD_TMP;
+  ROOT_MOVES_N = thread->root_moves_n;
+  memcpy(ROOT_MOVES, thread->root_moves, sizeof(ROOT_MOVES));
+  memcpy(REPETITION_POSITIONS, thread->repetitions, sizeof(REPETITION_POSITIONS));
+  RandomReset(thread->seed);
+  NnueReset();
+  UNDERPROMOS   = false;
+  QS_DEPTH      = 2;
+  for (DEPTH = THREAD_ID & 1; Abs(BEST_SCORE) < INF / 2 && DEPTH < MAX_DEPTH && !STOP_SEARCH; DEPTH++) {
+    BEST_SCORE = WTM ? BestW() : BestB();
+    QS_DEPTH   = Min(QS_DEPTH + 2, 12);
+  }
+  atomic_store_explicit(&thread->nodes, NODES, memory_order_relaxed);
+  return NULL;
+}
+
+static void HelpersStart(void) {
+  for (int i = 1; i < THREADS_N; i++) {
+    struct THREAD_T *const thread = &THREADS[i];
+    thread->id           = i;
+    thread->seed         = RANDOM_SEED + (uint64_t) i;
+    atomic_store_explicit(&thread->nodes, 0, memory_order_relaxed);
+    thread->board        = *BOARD;
+    thread->root_moves_n = ROOT_MOVES_N;
+    memcpy(thread->root_moves, ROOT_MOVES, sizeof(ROOT_MOVES));
+    memcpy(thread->repetitions, REPETITION_POSITIONS, sizeof(REPETITION_POSITIONS));
+    Assert(!pthread_create(&thread->thread, NULL, HelperThink, thread), "Error #7: Can't create thread !");
+  }
+}
+
+static void HelpersStop(void) {
+  STOP_SEARCH = true;
+  for (int i = 1; i < THREADS_N; i++)
+    pthread_join(THREADS[i].thread, NULL);
+}
+
+// Main thread only, cumulative over the search. Branching factor: Nodes of this iteration / last one
+static void StatsSpeak(const uint64_t iteration_nodes, const uint64_t last_nodes) {
+  const uint64_t *const cut = STATS.cutoffs;
+  const uint64_t cutoffs = cut[0] + cut[1] + cut[2] + cut[3] + cut[4] + cut[5] + cut[6] + cut[7];
+  Print("info string Nodes interior %llu quiescence %llu ebf %.2f", STATS.nodes, STATS.qnodes,
+        last_nodes ? (float) iteration_nodes / (float) last_nodes : 0.0f);
+  Print("info string Cutoffs %llu by move 1: %llu 2: %llu 3: %llu 4: %llu 5: %llu 6: %llu 7: %llu 8+: %llu (First %.1f%%)",
+        cutoffs, cut[0], cut[1], cut[2], cut[3], cut[4], cut[5], cut[6], cut[7], cutoffs ? 100.0f * cut[0] / cutoffs : 0.0f);
+  Print("info string LMR %llu re-searches %llu", STATS.lmr, STATS.lmr_researches);
+  Print("info string Hash hits %llu / %llu moves %llu move cutoffs %llu", STATS.hash_hits, STATS.hash_probes, STATS.hash_moves, STATS.hash_move_cutoffs);
+  Print("info string Eval cache hits %llu / %llu pawn hash hits %llu / %llu lazy eval hits %llu / %llu",
+        STATS.eval_hits, STATS.eval_probes, STATS.pawn_hits, STATS.pawn_probes, STATS.lazy_hits, STATS.lazy_probes);
+}
+
 static void ThinkSetup(const int think_time) {
   STOP_SEARCH = false;
   BEST_SCORE = NODES = DEPTH = 0;
+  memset(&STATS, 0, sizeof(STATS));
   QS_DEPTH = 2;
-  STOP_SEARCH_TIME = Now() + (uint64_t) Max(0, think_time);
+  HASH_AGE = (HASH_AGE + 1) & 0x3F;
+  memset(KILLERS, 0, sizeof(KILLERS));
+  HARD_TIME = Max(0, think_time);
+  TM_START  = NowCoarse();
+  STOP_SEARCH_TIME = TM_START + (uint64_t) HARD_TIME;
 }
 
 static void RandomMove(void) {
@@ -1784,39 +3202,533 @@ static bool ThinkRandomMove(void) {
 }
 
 static void Think(const int think_time) {
-  struct BOARD_T *const tmp = BOARD;
   const uint64_t start = Now();
   ThinkSetup(think_time);
   MgenRootAll();
   if (ROOT_MOVES_N <= 1 || ThinkRandomMove()) {
-    Speak(0, 0);
+    Speak(0, 0, 1);
     return;
   }
   UNDERPROMOS = false;
-  for (; Abs(BEST_SCORE) < INF / 2 && DEPTH < MAX_DEPTH && !STOP_SEARCH; DEPTH++) {
+  HelpersStart();
+  bool soft_stop = false;
+  uint16_t best = 0;
+  int stable = 0, drop = 0, score = 0;
+  for (uint64_t nodes[2] = {0}; Abs(BEST_SCORE) < INF / 2 && DEPTH < MAX_DEPTH && !STOP_SEARCH; DEPTH++) {
     BEST_SCORE = WTM ? BestW() : BestB();
-    Speak(BEST_SCORE, Now() - start);
+    Speak(BEST_SCORE, Now() - start, Min(MULTIPV, ROOT_MOVES_N));
+    if (SHOW_STATS)
+      StatsSpeak(NODES - nodes[1], nodes[1] - nodes[0]);
+    nodes[0] = nodes[1];
+    nodes[1] = NODES;
     QS_DEPTH = Min(QS_DEPTH + 2, 12);
+    if (!TM_SOFT || STOP_SEARCH)
+      continue;
+    stable = ROOT_MOVES[0].move == best ? stable + 1 : 0;
+    drop   = DEPTH ? score - (WTM ? BEST_SCORE : -BEST_SCORE) : 0; // Side to move POV
+    best   = ROOT_MOVES[0].move;
+    score  = WTM ? BEST_SCORE : -BEST_SCORE;
+    if ((soft_stop = TimeIteration(stable, drop)))
+      break;
   }
+  if (TM_SOFT)
+    TimeSpeak(soft_stop ? "soft" : UserStop() ? "stop" : STOP_SEARCH ? "hard" : "done", stable, drop);
+  HelpersStop();
   UNDERPROMOS = true;
-  BOARD = tmp;
-  Speak(BEST_SCORE, Now() - start);
+  Speak(BEST_SCORE, Now() - start, Min(MULTIPV, ROOT_MOVES_N));
+}
+
+// Perft
+
+static uint64_t PerftB(const int);
+
+// Direct mapped over the search hash (Cleared before and after). Keys include the depth
+static inline uint64_t PerftKey(const bool wtm, const int depth) {
+  return Hash(wtm) ^ (0x9E3779B97F4A7C15ULL * (uint64_t) depth);
+}
+
+static bool PerftProbe(const uint64_t key, uint64_t *const nodes) {
+  if (!PERFT_HASH)
+    return false;
+  const struct PERFT_HASH_T entry = ((const struct PERFT_HASH_T *) HASH)[key & PERFT_KEY];
+  if ((entry.lock ^ entry.nodes) != key)
+    return false;
+  *nodes = entry.nodes;
+  return true;
+}
+
+static void PerftStore(const uint64_t key, const uint64_t nodes) {
+  if (!PERFT_HASH)
+    return;
+  struct PERFT_HASH_T *const entry = &((struct PERFT_HASH_T *) HASH)[key & PERFT_KEY];
+  entry->nodes = nodes;
+  entry->lock  = key ^ nodes;
+}
+
+// Bulk counting: Legal moves at the last ply
+static uint64_t PerftW(const int depth) {
+  struct MOVE_T moves[MAX_MOVES];
+  struct UNDO_T undo;
+  const int moves_n = MgenW(moves);
+  if (depth <= 1)
+    return moves_n;
+  const uint64_t key = PerftKey(true, depth);
+  uint64_t nodes = 0;
+  if (PerftProbe(key, &nodes))
+    return nodes;
+  for (int i = 0; i < moves_n; i++) {
+    MakeMoveW(moves[i].move, &undo);
+    nodes += PerftB(depth - 1);
+    UnmakeMoveW(moves[i].move, &undo);
+  }
+  PerftStore(key, nodes);
+  return nodes;
+}
+
+static uint64_t PerftB(const int depth) {
+  struct MOVE_T moves[MAX_MOVES];
+  struct UNDO_T undo;
+  const int moves_n = MgenB(moves);
+  if (depth <= 1)
+    return moves_n;
+  const uint64_t key = PerftKey(false, depth);
+  uint64_t nodes = 0;
+  if (PerftProbe(key, &nodes))
+    return nodes;
+  for (int i = 0; i < moves_n; i++) {
+    MakeMoveB(moves[i].move, &undo);
+    nodes += PerftW(depth - 1);
+    UnmakeMoveB(moves[i].move, &undo);
+  }
+  PerftStore(key, nodes);
+  return nodes;
+}
+
+static int PerftNext(void) {
+  pthread_mutex_lock(&PERFT_LOCK);
+  const int root_i = PERFT_NEXT++;
+  pthread_mutex_unlock(&PERFT_LOCK);
+  return root_i;
+}
+
+// Every thread takes the next unsearched root move
+static void PerftSplit(void) {
+  struct UNDO_T undo;
+  for (int i; (i = PerftNext()) < ROOT_MOVES_N;) {
+    const uint16_t move = ROOT_MOVES[i].move;
+    if (WTM) {
+      MakeMoveW(move, &undo);
+      PERFT_COUNTS[i] = PERFT_DEPTH > 1 ? PerftB(PERFT_DEPTH - 1) : 1;
+      UnmakeMoveW(move, &undo);
+    } else {
+      MakeMoveB(move, &undo);
+      PERFT_COUNTS[i] = PERFT_DEPTH > 1 ? PerftW(PERFT_DEPTH - 1) : 1;
+      UnmakeMoveB(move, &undo);
+    }
+  }
+}
+
+static void *PerftHelper(void *const arg) {
+  struct THREAD_T *const thread = (struct THREAD_T *) arg;
+  BOARD_TMP    = thread->board;
+  BOARD        = &BOARD_TMP;
+  ROOT_MOVES_N = thread->root_moves_n;
+  memcpy(ROOT_MOVES, thread->root_moves, sizeof(ROOT_MOVES));
+  NnueReset();
+  PerftSplit();
+  return NULL;
+}
+
+static uint64_t Perft(const int depth, const bool hash) {
+  uint64_t nodes = 0;
+  PERFT_DEPTH = depth;
+  PERFT_HASH  = hash;
+  PERFT_KEY   = HASH_BYTES / sizeof(struct PERFT_HASH_T) - 1;
+  PERFT_NEXT  = 0;
+  MgenRoot();
+  if (depth <= 0)
+    return 1;
+  if (hash)
+    HashClear();
+  for (int i = 1; i < THREADS_N; i++) {
+    THREADS[i].board        = *BOARD;
+    THREADS[i].root_moves_n = ROOT_MOVES_N;
+    memcpy(THREADS[i].root_moves, ROOT_MOVES, sizeof(ROOT_MOVES));
+    Assert(!pthread_create(&THREADS[i].thread, NULL, PerftHelper, &THREADS[i]), "Error #7: Can't create thread !");
+  }
+  PerftSplit();
+  for (int i = 1; i < THREADS_N; i++)
+    pthread_join(THREADS[i].thread, NULL);
+  if (hash)
+    HashClear();
+  for (int i = 0; i < ROOT_MOVES_N; i++)
+    nodes += PERFT_COUNTS[i];
+  return nodes;
+}
+
+static void PerftSpeak(const int depth, const uint64_t nodes, const uint64_t perft_time) {
+  Print("perft %i nodes %llu time %llu mnps %.2f", depth, nodes, perft_time, Nps(nodes, perft_time) / 1000000.0f);
+}
+
+// Usage: perft <depth> [nohash]
+static void UciPerft(const bool divide) {
+  const int depth = Max(0, TokenNumber());
+  TokenPop(1);
+  const uint64_t start = Now(), nodes = Perft(depth, !Token("nohash"));
+  if (divide)
+    for (int i = 0; depth > 0 && i < ROOT_MOVES_N; i++)
+      Print("%s %llu", MoveName(ROOT_MOVES[i].move), PERFT_COUNTS[i]);
+  PerftSpeak(depth, nodes, Now() - start);
+}
+
+// Reference counts for checking the move generator after changes
+static void UciPerftSuite(void) {
+  const int suite_n = (int) (sizeof(PERFT_SUITE) / sizeof(PERFT_SUITE[0]));
+  const uint64_t start = Now();
+  uint64_t total = 0;
+  int passed = 0;
+  for (int i = 0; i < suite_n; i++) {
+    Fen(PERFT_SUITE[i].fen);
+    const uint64_t nodes = Perft(PERFT_SUITE[i].depth, true);
+    passed += nodes == PERFT_SUITE[i].nodes;
+    total  += nodes;
+    Print("%s %s perft %i nodes %llu expected %llu", nodes == PERFT_SUITE[i].nodes ? "ok" : "FAILED",
+          PERFT_SUITE[i].fen, PERFT_SUITE[i].depth, nodes, PERFT_SUITE[i].nodes);
+  }
+  const uint64_t perft_time = Now() - start;
+  Print("perft suite passed %i / %i nodes %llu time %llu mnps %.2f", passed, suite_n, total, perft_time, Nps(total, perft_time) / 1000000.0f);
+  Fen(STARTPOS);
+}
+
+// Bench
+
+// Fixed depth from a clean state. Node counts are reproducible with 1 thread
+static void Bench(const int depth, const int threads, const int hash_mb) {
+  const int fens_n = (int) (sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0])), threads_n = THREADS_N, hash_size_mb = HASH_SIZE_MB, level = LEVEL;
+  const int multipv = MULTIPV, lazy_margin = LAZY_MARGIN;
+  const bool nnue_on = NNUE_ON;
+  const uint64_t seed = RANDOM_SEED;
+  uint64_t nodes = 0, bench_time = 0, random_bb[3];
+  memcpy(random_bb, RANDOM_BB, sizeof(RANDOM_BB));
+  THREADS_N   = threads;
+  LEVEL       = 100;
+  MULTIPV     = 1;
+  LAZY_MARGIN = LAZY_CP;
+  NNUE_ON     = false;
+  MAX_DEPTH   = depth;
+  HashResize(hash_mb);
+  memset(EVAL_HASH, 0, sizeof(EVAL_HASH));
+  memset(PAWN_HASH, 0, sizeof(PAWN_HASH));
+  for (int i = 0; i < fens_n; i++) {
+    Fen(BENCH_FENS[i]);
+    HashClear();
+    RandomReset(BENCH_SEED);
+    memset(REPETITION_POSITIONS, 0, sizeof(REPETITION_POSITIONS));
+    const uint64_t start = Now();
+    Think(INF);
+    const uint64_t fen_nodes = NodesAll(), fen_time = Now() - start;
+    Print("bench %i nodes %llu time %llu nps %llu bestmove %s", i + 1, fen_nodes, fen_time, Nps(fen_nodes, fen_time), MoveName(ROOT_MOVES[0].move));
+    nodes      += fen_nodes;
+    bench_time += fen_time;
+  }
+  Print("bench depth %i threads %i hash %i nodes %llu time %llu nps %llu", depth, threads, HASH_SIZE_MB, nodes, bench_time, Nps(nodes, bench_time));
+  Print("bench signature %llu", nodes);
+  THREADS_N   = threads_n;
+  LEVEL       = level;
+  MULTIPV     = multipv;
+  LAZY_MARGIN = lazy_margin;
+  NNUE_ON     = nnue_on;
+  MAX_DEPTH   = DEPTH_LIMIT;
+  RANDOM_SEED = seed;
+  memcpy(RANDOM_BB, random_bb, sizeof(RANDOM_BB));
+  HashResize(hash_size_mb);
+  HashClear();
+  memset(EVAL_HASH, 0, sizeof(EVAL_HASH)); // Bench evals are from EvalAll()
+  Fen(STARTPOS);
+}
+
+// Usage: bench [depth] [threads] [hash]
+static void UciBench(void) {
+  int args[3] = {BENCH_DEPTH, 1, HASH_MB};
+  for (int i = 0; i < 3 && TokenOk(); i++, TokenPop(1))
+    args[i] = TokenNumber();
+  Bench(Between(1, args[0], DEPTH_LIMIT), Between(1, args[1], MAX_THREADS), Between(1, args[2], HASH_MAX_MB));
+}
+
+// EPD
+
+// Operand of an opcode without quotes and blanks
+static void EpdOperand(char *const dst, const size_t size, const char *from, const char *to) {
+  while (from < to && strchr(" \t\"", *from))
+    from++;
+  while (to > from && strchr(" \t\r\n\"", to[-1]))
+    to--;
+  snprintf(dst, size, "%.*s", (int) (to - from), from);
+}
+
+// "<board> <side> <castling> <ep> bm Qd1+; id "BK.01";" Returns false on blank lines
+static bool EpdParse(const char *line, struct EPD_T *const epd) {
+  char fields[4][90] = {{0}};
+  int len = 0;
+  memset(epd, 0, sizeof(*epd));
+  if (sscanf(line, "%89s %89s %89s %89s%n", fields[0], fields[1], fields[2], fields[3], &len) != 4)
+    return false;
+  snprintf(epd->fen, sizeof(epd->fen), "%s %s %s %s 0", fields[0], fields[1], fields[2], fields[3]);
+  for (line += len; ; line++) {
+    char op[16] = "";
+    if (sscanf(line, " %15[^; \t\r\n]%n", op, &len) != 1)
+      break;
+    line += len;
+    const char *const end = strchr(line, ';') ? strchr(line, ';') : line + strlen(line);
+    if (     !strcmp(op, "bm")) EpdOperand(epd->bm, sizeof(epd->bm), line, end);
+    else if (!strcmp(op, "am")) EpdOperand(epd->am, sizeof(epd->am), line, end);
+    else if (!strcmp(op, "id")) EpdOperand(epd->id, sizeof(epd->id), line, end);
+    line = end;
+    if (*line == '\0')
+      break;
+  }
+  return true;
+}
+
+// SAN (Nf3, exd5, e8=Q, O-O) or coordinates (g1f3)
+static bool EpdMoveIs(const uint16_t move, const char *const san) {
+  char str[16] = "";
+  int len = 0, piece = 1, promo = 0, file = -1, rank = -1;
+  const int type = MoveType(move), from = MoveFrom(move);
+  if (!strcmp(MoveName(move), san))
+    return true;
+  if (!strncmp(san, "O-O", 3) || !strncmp(san, "0-0", 3))
+    return type == (WTM ? 1 : 3) + (!strncmp(san, "O-O-O", 5) || !strncmp(san, "0-0-0", 5));
+  for (const char *c = san; *c && len < 15; c++)
+    if (!strchr("x=+#!?", *c))
+      str[len++] = *c;
+  if (len >= 1 && strchr("NBRQK", str[0]))
+    piece = Piece(str[0]);
+  if (len >= 3 && strchr("NBRQ", str[len - 1]))
+    promo = Piece(str[--len]);
+  if (len < 2 + (piece != 1) || (type >= 1 && type <= 4))
+    return false;
+  for (int i = piece != 1; i < len - 2; i++)
+    if (str[i] >= 'a' && str[i] <= 'h')
+      file = str[i] - 'a';
+    else if (str[i] >= '1' && str[i] <= '8')
+      rank = str[i] - '1';
+  return Abs(BOARD->board[from]) == piece
+      && MoveTo(move) == 8 * (str[len - 1] - '1') + (str[len - 2] - 'a')
+      && (type >= 5 ? type - 3 == promo : !promo)
+      && (file < 0 || Xcoord(from) == file)
+      && (rank < 0 || Ycoord(from) == rank);
+}
+
+static bool EpdMoveIn(const uint16_t move, const char *list) {
+  char san[16] = "";
+  for (int len = 0; sscanf(list, " %15s%n", san, &len) == 1; list += len)
+    if (EpdMoveIs(move, san))
+      return true;
+  return false;
+}
+
+// Each position from a clean hash. Solved: Best move in bm and not in am
+static void EpdSolve(const struct EPD_T *const epd, const int index, const int movetime, struct EPD_RESULT_T *const result) {
+  Fen(epd->fen);
+  HashClear();
+  memset(REPETITION_POSITIONS, 0, sizeof(REPETITION_POSITIONS));
+  const uint64_t start = Now();
+  Think(movetime);
+  const uint64_t epd_time = Now() - start;
+  const uint16_t best = ROOT_MOVES_N > 0 ? ROOT_MOVES[0].move : 0;
+  result->nodes  = NodesAll();
+  result->solved = best && (epd->bm[0] || epd->am[0])
+                && (!epd->bm[0] || EpdMoveIn(best, epd->bm)) && (!epd->am[0] || !EpdMoveIn(best, epd->am));
+  snprintf(result->report, sizeof(result->report), "epd %i %s best %s bm %s am %s nodes %llu time %llu id %s",
+           index + 1, result->solved ? "solved" : "failed", best ? MoveName(best) : "0000",
+           epd->bm[0] ? epd->bm : "-", epd->am[0] ? epd->am : "-", (unsigned long long) result->nodes, (unsigned long long) epd_time, epd->id[0] ? epd->id : "-");
+}
+
+static void EpdReport(const struct EPD_RESULT_T *const result) {
+  Print("%s", result->report);
+  EPD_SOLVED += result->solved;
+  EPD_NODES  += result->nodes;
+  EPD_DONE++;
+}
+
+// Job j takes positions j, j + jobs, ... Workers are processes: Setup state (Side to move, castling, clock) is global
+static void EpdJob(const struct EPD_T *const epds, const int epds_n, const int job, const int jobs, const int movetime, const int fd) {
+  struct EPD_RESULT_T result;
+  for (int i = job; i < epds_n; i += jobs) {
+    memset(&result, 0, sizeof(result));
+    EpdSolve(epds + i, i, movetime, &result);
+    if (fd < 0)
+      EpdReport(&result);
+    else
+      Assert(write(fd, &result, sizeof(result)) == (ssize_t) sizeof(result), "Error #15: Can't write results !");
+  }
+}
+
+#ifdef WINDOWS
+static int EpdJobs(const struct EPD_T *const epds, const int epds_n, const int jobs, const int movetime) {
+  (void) jobs; // No fork()
+  EpdJob(epds, epds_n, 0, 1, movetime, -1);
+  return 1;
+}
+#else
+// Returns the number of workers used
+static int EpdJobs(const struct EPD_T *const epds, const int epds_n, const int jobs, const int movetime) {
+  struct EPD_RESULT_T result;
+  int fds[2] = {0};
+  if (jobs <= 1) {
+    EpdJob(epds, epds_n, 0, 1, movetime, -1);
+    return 1;
+  }
+  Assert(!pipe(fds), "Error #13: Can't create pipe !");
+  fflush(stdout);
+  for (int job = 0; job < jobs; job++) {
+    const pid_t pid = fork();
+    Assert(pid >= 0, "Error #14: Can't fork !");
+    if (!pid) {
+      close(fds[0]);
+      EpdJob(epds, epds_n, job, jobs, movetime, fds[1]);
+      _exit(EXIT_SUCCESS);
+    }
+  }
+  close(fds[1]);
+  while (read(fds[0], &result, sizeof(result)) == (ssize_t) sizeof(result))
+    EpdReport(&result);
+  close(fds[0]);
+  while (wait(NULL) > 0);
+  return jobs;
+}
+#endif
+
+// Usage: sapeli epd <file> [--movetime ms] [--depth n] [--jobs n] [--hash mb]
+static int Epd(const int argc, char **const argv) {
+  int movetime = 1000, depth = DEPTH_LIMIT, jobs = 1, hash_mb = HASH_MB, epds_n = 0;
+  for (int i = 3; i + 1 < argc; i += 2)
+    if (     !strcmp(argv[i], "--movetime")) movetime = Max(1, atoi(argv[i + 1]));
+    else if (!strcmp(argv[i], "--depth"))    depth    = Between(1, atoi(argv[i + 1]), DEPTH_LIMIT);
+    else if (!strcmp(argv[i], "--jobs"))     jobs     = Between(1, atoi(argv[i + 1]), MAX_THREADS);
+    else if (!strcmp(argv[i], "--hash"))     hash_mb  = Between(1, atoi(argv[i + 1]), HASH_MAX_MB);
+  FILE *const file = fopen(argv[2], "r");
+  Assert(file != NULL, "Error #16: Can't open EPD file !");
+  struct EPD_T *epds = NULL, epd;
+  char line[INPUT_SIZE] = "";
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#' || !EpdParse(line, &epd))
+      continue;
+    epds = (struct EPD_T *) realloc(epds, (size_t) (epds_n + 1) * sizeof(struct EPD_T));
+    Assert(epds != NULL, "Error #17: Can't allocate EPD positions !");
+    epds[epds_n++] = epd;
+  }
+  fclose(file);
+  SILENT    = true;
+  MAX_DEPTH = depth;
+  HashResize(hash_mb);
+  const uint64_t start = Now();
+  const int workers = EpdJobs(epds, epds_n, Min(jobs, Max(1, epds_n)), movetime);
+  const uint64_t epd_time = Now() - start;
+  Print("epd solved %i / %i nodes %llu time %llu nps %llu jobs %i", EPD_SOLVED, epds_n, EPD_NODES, epd_time, Nps(EPD_NODES, epd_time), workers);
+  free(epds);
+  return EPD_DONE == epds_n ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Input
+
+// A reader thread owns stdin. "stop", "ponderhit" and "isready" during a search are handled at once,
+// everything else is queued for the main thread. "quit" waits its turn, so piped scripts finish
+static bool InputIs(const char *const line, const char *const cmd) {
+  char first[INPUT_SIZE] = "";
+  return sscanf(line, "%8191s", first) == 1 && !strcmp(first, cmd);
+}
+
+// Under INPUT_LOCK. Taken lines are compacted away before the queue grows
+static void InputPush(const char *const line) {
+  if (INPUT_I + INPUT_N >= INPUT_CAP) {
+    if (INPUT_I) {
+      memmove(INPUT_QUEUE, INPUT_QUEUE + INPUT_I, (size_t) INPUT_N * sizeof(char *));
+      INPUT_I = 0;
+    } else {
+      INPUT_CAP   = Max(INPUT_LINES, 2 * INPUT_CAP);
+      INPUT_QUEUE = (char **) realloc(INPUT_QUEUE, (size_t) INPUT_CAP * sizeof(char *));
+      Assert(INPUT_QUEUE != NULL, "Error #20: Can't allocate input !");
+    }
+  }
+  char *const copy = (char *) malloc(strlen(line) + 1);
+  Assert(copy != NULL, "Error #20: Can't allocate input !");
+  strcpy(copy, line);
+  INPUT_QUEUE[INPUT_I + INPUT_N++] = copy;
+  INPUT_READ++;
+}
+
+static void *InputThread(void *arg) {
+  char str[INPUT_SIZE] = "";
+  (void) arg;
+  while (fgets(str, sizeof(str), stdin) != NULL) {
+    if (InputIs(str, "stop")) {
+      USER_STOP = INPUT_READ;
+      continue;
+    }
+    if (InputIs(str, "ponderhit")) {
+      PONDER_HIT = true;
+      continue;
+    }
+    pthread_mutex_lock(&INPUT_LOCK);
+    if (INPUT_SEARCHES && InputIs(str, "isready")) {
+      pthread_mutex_unlock(&INPUT_LOCK);
+      Print("readyok");
+      continue;
+    }
+    if (InputIs(str, "go")) {
+      INPUT_SEARCHES++;
+      PONDER_HIT = false;
+    }
+    InputPush(str);
+    pthread_cond_broadcast(&INPUT_COND);
+    pthread_mutex_unlock(&INPUT_LOCK);
+  }
+  pthread_mutex_lock(&INPUT_LOCK);
+  INPUT_EOF = true;
+  pthread_cond_broadcast(&INPUT_COND);
+  pthread_mutex_unlock(&INPUT_LOCK);
+  return NULL;
+}
+
+static void InputSearchDone(void) {
+  pthread_mutex_lock(&INPUT_LOCK);
+  INPUT_SEARCHES = Max(0, INPUT_SEARCHES - 1);
+  pthread_mutex_unlock(&INPUT_LOCK);
+}
+
+static void Input(void) {
+  pthread_mutex_lock(&INPUT_LOCK);
+  while (!INPUT_N && !INPUT_EOF)
+    pthread_cond_wait(&INPUT_COND, &INPUT_LOCK);
+  const bool ok = INPUT_N > 0;
+  if (ok) {
+    strcpy(INPUT_LINE, INPUT_QUEUE[INPUT_I]);
+    free(INPUT_QUEUE[INPUT_I]);
+    INPUT_I = --INPUT_N ? INPUT_I + 1 : 0;
+    INPUT_SEQ++;
+  }
+  pthread_mutex_unlock(&INPUT_LOCK);
+  Assert(ok, "Error #1: Read line returns NULL !");
+  CreateTokens(INPUT_LINE);
 }
 
 // UCI
 
 static void MakeMove(const int root_i) {
+  struct UNDO_T undo;
   REPETITION_POSITIONS[BOARD->rule50] = Hash(WTM);
-  BOARD_TMP = ROOT_MOVES[root_i];
-  BOARD     = &BOARD_TMP;
-  WTM       = !WTM;
+  WTM ? MakeMoveW(ROOT_MOVES[root_i].move, &undo) : MakeMoveB(ROOT_MOVES[root_i].move, &undo);
+  WTM = !WTM;
+  NnueReset();
 }
 
 static void UciMove(void) {
   const char *const move = TokenCurrent();
   MgenRoot();
   for (int i = 0; i < ROOT_MOVES_N; i++) {
-    if (!strcmp(MoveName(ROOT_MOVES + i), move)) {
+    if (!strcmp(MoveName(ROOT_MOVES[i].move), move)) {
       MakeMove(i);
       return;
     }
@@ -1861,17 +3773,76 @@ static void UciSetoption(void) {
     TokenPop(3);
     MOVEOVERHEAD = Between(0, TokenNumber(), 5000);
     TokenPop(1);
+  } else if (Peek("name", 0) && Peek("LazyMargin", 1) && Peek("value", 2)) {
+    TokenPop(3);
+    LAZY_MARGIN = Between(0, TokenNumber(), 10000);
+    TokenPop(1);
+  } else if (Peek("name", 0) && Peek("Hash", 1) && Peek("value", 2)) {
+    TokenPop(3);
+    HashResize(Between(1, TokenNumber(), HASH_MAX_MB));
+    HashInfo();
+    TokenPop(1);
+  } else if (Peek("name", 0) && Peek("Threads", 1) && Peek("value", 2)) {
+    TokenPop(3);
+    THREADS_N = Between(1, TokenNumber(), MAX_THREADS);
+    TokenPop(1);
+  } else if (Peek("name", 0) && Peek("MultiPV", 1) && Peek("value", 2)) {
+    TokenPop(3);
+    MULTIPV = Between(1, TokenNumber(), MAX_MOVES);
+    TokenPop(1);
+  } else if (Peek("name", 0) && Peek("Ponder", 1) && Peek("value", 2)) {
+    PONDER = Peek("true", 3);
+    TokenPop(4);
+  } else if (Peek("name", 0) && Peek("Stats", 1) && Peek("value", 2)) {
+    SHOW_STATS = Peek("true", 3);
+    TokenPop(4);
+  } else if (Peek("name", 0) && Peek("UseNNUE", 1) && Peek("value", 2)) {
+    USE_NNUE = Peek("true", 3);
+    NnueSetup();
+    TokenPop(4);
+  } else if (Peek("name", 0) && Peek("EvalFile", 1) && Peek("value", 2)) {
+    TokenPop(3);
+    snprintf(NNUE_FILE, sizeof(NNUE_FILE), "%s", TokenCurrent());
+    NnueSetup();
+    TokenPop(1);
+  } else if (Peek("name", 0) && Peek("Clear", 1) && Peek("Hash", 2)) {
+    HashClear();
+    TokenPop(3);
   }
 }
 
+// Expected reply from the hash. 0 if there is none
+static uint16_t PonderMove(void) {
+  struct UNDO_T undo;
+  struct HASH_T entry;
+  const uint16_t move = ROOT_MOVES[0].move;
+  WTM ? MakeMoveW(move, &undo) : MakeMoveB(move, &undo);
+  const bool ok = HashProbe(Hash(!WTM), &entry) && entry.move && (WTM ? MoveLegalB(entry.move) : MoveLegalW(entry.move));
+  WTM ? UnmakeMoveW(move, &undo) : UnmakeMoveB(move, &undo);
+  return ok ? entry.move : 0;
+}
+
+// Pondering ends with "ponderhit" or "stop" even if the search is done
+static void PonderWait(void) {
+  while (PONDERING && !PONDER_HIT && !UserStop())
+    usleep(1000);
+  PONDERING = false;
+}
+
 static void PrintBestMove(void) {
-  Print("bestmove %s", ROOT_MOVES_N <= 0 ? "0000" : MoveName(&ROOT_MOVES[0]));
+  char best[6] = "";
+  PonderWait();
+  if (ROOT_MOVES_N <= 0) {
+    Print("bestmove 0000");
+    return;
+  }
+  strcpy(best, MoveName(ROOT_MOVES[0].move));
+  const uint16_t reply = PONDER ? PonderMove() : 0;
+  reply ? Print("bestmove %s ponder %s", best, MoveName(reply)) : Print("bestmove %s", best);
 }
 
 static void UciGoInfinite(void) {
-  ANALYZING = true;
   Think(INF);
-  ANALYZING = false;
   PrintBestMove();
 }
 
@@ -1891,8 +3862,10 @@ static void UciGoMovetime(void) {
 
 static void UciGo(void) {
   int wtime = 0, btime = 0, winc  = 0, binc = 0, mtg = 30;
+  PONDERING = false;
   for (; TokenOk(); TokenPop(1)) {
     if (     Token("infinite"))  {UciGoInfinite(); return;}
+    else if (TokenIs("ponder"))  {PONDERING = true;}
     else if (Token("wtime"))     {wtime = Max(0, TokenNumber() - MOVEOVERHEAD);}
     else if (Token("btime"))     {btime = Max(0, TokenNumber() - MOVEOVERHEAD);}
     else if (Token("winc"))      {winc = Max(0, TokenNumber() - MOVEOVERHEAD);}
@@ -1901,7 +3874,9 @@ static void UciGo(void) {
     else if (Token("movetime"))  {UciGoMovetime(); return;}
     else if (Token("depth"))     {UciGoDepth(); return;}
   }
-  Think(Max(0, WTM ? wtime / mtg + winc : btime / mtg + binc));
+  TimeSetup(WTM ? wtime : btime, WTM ? winc : binc, mtg);
+  Think(TM_HARD);
+  TM_SOFT = 0;
   PrintBestMove();
 }
 
@@ -1911,17 +3886,30 @@ static void UciUci(void) {
   Print("option name UCI_Chess960 type check default %s", CHESS960 ? "true" : "false");
   Print("option name Level type spin default %i min 0 max 100", LEVEL);
   Print("option name MoveOverhead type spin default %i min 0 max 5000", MOVEOVERHEAD);
+  Print("option name LazyMargin type spin default %i min 0 max 10000", LAZY_MARGIN);
+  Print("option name Hash type spin default %i min 1 max %i", HASH_MB, HASH_MAX_MB);
+  Print("option name Threads type spin default 1 min 1 max %i", MAX_THREADS);
+  Print("option name MultiPV type spin default 1 min 1 max %i", MAX_MOVES);
+  Print("option name Ponder type check default %s", PONDER ? "true" : "false");
+  Print("option name Stats type check default %s", SHOW_STATS ? "true" : "false");
+  Print("option name UseNNUE type check default %s", USE_NNUE ? "true" : "false");
+  Print("option name EvalFile type string default %s", NNUE_FILE);
+  Print("option name Clear Hash type button");
   Print("uciok");
 }
 
 static bool UciCommands(void) {
   if (TokenOk()) {
-    if (     Token("position"))  UciPosition();
-    else if (Token("go"))        UciGo();
-    else if (Token("isready"))   Print("readyok");
-    else if (Token("setoption")) UciSetoption();
-    else if (Token("uci"))       UciUci();
-    else if (Token("quit"))      return false;
+    if (     Token("position"))   UciPosition();
+    else if (Token("go"))         {UciGo(); InputSearchDone();}
+    else if (Token("isready"))    Print("readyok");
+    else if (Token("ucinewgame")) HashClear();
+    else if (Token("setoption"))  UciSetoption();
+    else if (Token("uci"))        UciUci();
+    else if (Token("perft"))      Token("suite") ? UciPerftSuite() : UciPerft(false);
+    else if (Token("divide"))     UciPerft(true);
+    else if (Token("bench"))      UciBench();
+    else if (Token("quit"))       return false;
   }
   for (; TokenOk(); TokenPop(1)); // Ignore the rest
   return true;
@@ -1932,60 +3920,196 @@ static bool Uci(void) {
   return UciCommands();
 }
 
-static void UciLoop(void) {
+static void UciLoop(const uint64_t startup_us) {
+  pthread_t input;
+  Assert(!pthread_create(&input, NULL, InputThread, NULL), "Error #12: Can't create input thread !");
+  pthread_detach(input);
   Print("%s by Toni Helminen", NAME);
+  Print("info string Startup %llu us", startup_us);
   while (Uci());
 }
 
-// Init
+// Gensfen
 
-static uint64_t PermutateBb(const uint64_t moves, const int index) {
-  int total = 0, good[64] = {0};
-  uint64_t permutations = 0;
-  for (int i = 0; i < 64; i++)
-    if (moves & Bit(i))
-      good[total++] = i;
-  const int popn = PopCount(moves);
-  for (int i = 0; i < popn; i++)
-    if ((1 << i) & index)
-      permutations |= Bit(good[i]);
-  return permutations & moves;
+// Only quiet positions are kept: Not in check and a quiet best move
+static bool GenQuiet(const uint16_t move) {
+  const int type = MoveType(move), from = MoveFrom(move), to = MoveTo(move);
+  if (WTM ? ChecksB() : ChecksW())
+    return false;
+  if (type >= 1 && type <= 4)
+    return true;
+  return type == 0 && !BOARD->board[to] && !(Abs(BOARD->board[from]) == 1 && Xcoord(from) != Xcoord(to));
 }
 
-static uint64_t MakeSliderMagicMoves(const int *const slider_vectors, const int square, const uint64_t moves) {
-  uint64_t possible_moves = 0;
-  const int x_square = Xcoord(square), y_square = Ycoord(square);
-  for (int i = 0; i < 4; i++)
-    for (int j = 1; j < 8; j++) {
-      const int x = x_square + j * slider_vectors[2 * i], y = y_square + j * slider_vectors[2 * i + 1];
-      if (!OnBoard(x, y))
-        break;
-      const uint64_t tmp = Bit(8 * y + x);
-      possible_moves |= tmp;
-      if (tmp & moves)
-        break;
+static void GenPack(struct SFEN_T *const sfen, const int ply, const uint16_t move) {
+  memset(sfen, 0, sizeof(*sfen));
+  sfen->occupied = Both();
+  int i = 0;
+  for (uint64_t both = sfen->occupied; both; both = ClearBit(both), i++) {
+    const int piece = BOARD->board[Ctz(both)];
+    sfen->pieces[i / 2] |= (uint8_t) ((piece > 0 ? piece : 8 - piece) << (4 * (i & 1)));
+  }
+  sfen->score  = (int16_t) Between(-32000, SpeakScore(BEST_SCORE), 32000);
+  sfen->move   = move;
+  sfen->ply    = (uint16_t) ply;
+  sfen->rule50 = (uint8_t) BOARD->rule50;
+  sfen->flags  = (uint8_t) (WTM | (BOARD->castle << 1));
+}
+
+// Random opening, then fixed nodes moves to mate, draw or GEN_PLIES. One fwrite() per game
+static int GenGame(FILE *const out, const int random_plies) {
+  static struct SFEN_T game[GEN_PLIES];
+  int sfens_n = 0, result = 0; // White POV
+  Fen(STARTPOS);
+  HashClear();
+  memset(REPETITION_POSITIONS, 0, sizeof(REPETITION_POSITIONS));
+  for (int ply = 0; ply < GEN_PLIES; ply++) {
+    REPETITION_POSITIONS[BOARD->rule50] = Hash(WTM);
+    MgenRoot();
+    if (!ROOT_MOVES_N) {
+      result = (WTM ? ChecksB() : ChecksW()) ? (WTM ? -1 : +1) : 0;
+      break;
     }
-  return possible_moves & (~Bit(square));
+    if (Draw())
+      break;
+    if (ply < random_plies) {
+      RandomMove();
+      MakeMove(0);
+      continue;
+    }
+    Think(INF);
+    if (Abs(BEST_SCORE) >= INF / 2) {
+      result = BEST_SCORE > 0 ? +1 : -1;
+      break;
+    }
+    if (ROOT_MOVES_N > 1 && GenQuiet(ROOT_MOVES[0].move))
+      GenPack(game + sfens_n++, ply, ROOT_MOVES[0].move);
+    MakeMove(0);
+  }
+  for (int i = 0; i < sfens_n; i++)
+    game[i].flags |= (uint8_t) (((game[i].flags & 1 ? result : -result) + 1) << 5);
+  Assert(fwrite(game, sizeof(struct SFEN_T), (size_t) sfens_n, out) == (size_t) sfens_n, "Error #19: Can't write positions !");
+  return sfens_n;
+}
+
+// Job j plays its games into <file>.j (Appended)
+static uint64_t GenJob(const char *const file, const int job, const int games, const int random_plies, const uint64_t seed) {
+  char name[512] = "";
+  uint64_t sfens = 0;
+  snprintf(name, sizeof(name), "%s.%i", file, job);
+  FILE *const out = fopen(name, "ab");
+  Assert(out != NULL, "Error #18: Can't open output file !");
+  RandomReset(seed + (uint64_t) job);
+  const uint64_t start = Now();
+  for (int i = 0; i < games; i++) {
+    sfens += (uint64_t) GenGame(out, random_plies);
+    if ((i + 1) % 100 == 0 || i + 1 == games)
+      Print("gensfen job %i games %i positions %llu time %llu pps %llu", job, i + 1, sfens, Now() - start, Nps(sfens, Now() - start));
+  }
+  fclose(out);
+  return sfens;
 }
 
-static void InitBishopMagics(void) {
-  for (int i = 0; i < 64; i++) {
-    const uint64_t magics = BISHOP_MOVE_MAGICS[i] & (~Bit(i));
-    for (int j = 0; j < 512; j++) {
-      const uint64_t allmoves = PermutateBb(magics, j);
-      BISHOP_MAGIC_MOVES[i][BishopMagicIndex(i, allmoves)] = MakeSliderMagicMoves(BISHOP_VECTORS, i, allmoves);
+#ifdef WINDOWS
+static uint64_t GenJobs(const char *const file, const int games, const int jobs, const int random_plies, const uint64_t seed) {
+  (void) jobs; // No fork()
+  return GenJob(file, 0, games, random_plies, seed);
+}
+#else
+static uint64_t GenJobs(const char *const file, const int games, const int jobs, const int random_plies, const uint64_t seed) {
+  uint64_t sfens = 0, job_sfens = 0;
+  int fds[2] = {0};
+  if (jobs <= 1)
+    return GenJob(file, 0, games, random_plies, seed);
+  Assert(!pipe(fds), "Error #13: Can't create pipe !");
+  fflush(stdout);
+  for (int job = 0; job < jobs; job++) {
+    const pid_t pid = fork();
+    Assert(pid >= 0, "Error #14: Can't fork !");
+    if (!pid) {
+      close(fds[0]);
+      job_sfens = GenJob(file, job, games / jobs + (job < games % jobs), random_plies, seed);
+      Assert(write(fds[1], &job_sfens, sizeof(job_sfens)) == (ssize_t) sizeof(job_sfens), "Error #15: Can't write results !");
+      _exit(EXIT_SUCCESS);
     }
   }
+  close(fds[1]);
+  while (read(fds[0], &job_sfens, sizeof(job_sfens)) == (ssize_t) sizeof(job_sfens))
+    sfens += job_sfens;
+  close(fds[0]);
+  while (wait(NULL) > 0);
+  return sfens;
+}
+#endif
+
+// Usage: sapeli gensfen <file> [--games n] [--nodes n] [--random plies] [--jobs n] [--hash mb] [--seed n]
+// Workers are processes like in Epd(). Output: <file>.<job> with struct SFEN_T records
+static int Gensfen(const int argc, char **const argv) {
+  int games = 1000, random_plies = 8, jobs = 1, hash_mb = 16;
+  uint64_t nodes = 5000, seed = RANDOM_SEED;
+  for (int i = 3; i + 1 < argc; i += 2)
+    if (     !strcmp(argv[i], "--games"))  games        = Max(1, atoi(argv[i + 1]));
+    else if (!strcmp(argv[i], "--nodes"))  nodes        = (uint64_t) Max(1, atoi(argv[i + 1]));
+    else if (!strcmp(argv[i], "--random")) random_plies = Between(0, atoi(argv[i + 1]), GEN_PLIES);
+    else if (!strcmp(argv[i], "--jobs"))   jobs         = Between(1, atoi(argv[i + 1]), MAX_THREADS);
+    else if (!strcmp(argv[i], "--hash"))   hash_mb      = Between(1, atoi(argv[i + 1]), HASH_MAX_MB);
+    else if (!strcmp(argv[i], "--seed"))   seed         = strtoull(argv[i + 1], NULL, 10);
+  SILENT    = true;
+  MAX_NODES = nodes;
+  HashResize(hash_mb);
+  const uint64_t start = Now();
+#ifdef WINDOWS
+  jobs = 1;
+#endif
+  jobs = Min(jobs, games);
+  const uint64_t sfens = GenJobs(argv[2], games, jobs, random_plies, seed);
+  const uint64_t gen_time = Now() - start;
+  Print("gensfen games %i positions %llu time %llu pps %llu jobs %i", games, sfens, gen_time, Nps(sfens, gen_time), jobs);
+  return EXIT_SUCCESS;
+}
+
+// Init
+
+static uint64_t MakeRay(const int square, const int dx, const int dy) {
+  uint64_t ray = 0;
+  for (int x = Xcoord(square) + dx, y = Ycoord(square) + dy; OnBoard(x, y); x += dx, y += dy)
+    ray |= Bit(8 * y + x);
+  return ray;
 }
 
-static void InitRookMagics(void) {
+// Occupancies by carry-rippler. Attacks from rays: The nearest blocker cuts the ray. Returns the end of the filled slices
+static uint64_t *InitSliders(struct SLIDER_T *const sliders, const uint64_t *const masks, const uint64_t *const magics, const int *const vectors, uint64_t *moves) {
+  uint64_t rays[64][4];
+  for (int i = 0; i < 64; i++)
+    for (int j = 0; j < 4; j++)
+      rays[i][j] = MakeRay(i, vectors[2 * j], vectors[2 * j + 1]);
   for (int i = 0; i < 64; i++) {
-    const uint64_t magics = ROOK_MOVE_MAGICS[i] & (~Bit(i));
-    for (int j = 0; j < 4096; j++) {
-      const uint64_t allmoves = PermutateBb(magics, j);
-      ROOK_MAGIC_MOVES[i][RookMagicIndex(i, allmoves)] = MakeSliderMagicMoves(ROOK_VECTORS, i, allmoves);
-    }
+    struct SLIDER_T *const slider = &sliders[i];
+    const int bits = PopCount(masks[i]);
+    slider->mask  = masks[i];
+    slider->magic = magics[i];
+    slider->shift = 64 - bits;
+    slider->moves = moves;
+    uint64_t occupied = 0;
+    do {
+      uint64_t attacks = 0;
+      for (int j = 0; j < 4; j++) {
+        const uint64_t blockers = rays[i][j] & occupied;
+        const bool up = 8 * vectors[2 * j + 1] + vectors[2 * j] > 0;
+        attacks |= blockers ? rays[i][j] ^ rays[up ? Ctz(blockers) : 63 - __builtin_clzll(blockers)][j] : rays[i][j];
+      }
+      slider->moves[MagicIndex(slider, occupied)] = attacks;
+      occupied = (occupied - masks[i]) & masks[i];
+    } while (occupied);
+    moves += 1 << bits;
   }
+  return moves;
+}
+
+static void InitSliderMagics(void) {
+  uint64_t *const end = InitSliders(ROOK_SLIDERS, ROOK_MASK, ROOK_MAGIC, ROOK_VECTORS,
+                                    InitSliders(BISHOP_SLIDERS, BISHOP_MASK, BISHOP_MAGIC, BISHOP_VECTORS, SLIDER_MOVES));
+  Assert(end == SLIDER_MOVES + SLIDER_MOVES_N, "Error #10: Bad slider tables !");
 }
 
 static uint64_t MakeSliderMoves(const int square, const int *const slider_vectors) {
@@ -2024,6 +4148,25 @@ static uint64_t MakeJumpMoves(const int square, const int len, const int dy, con
   return moves;
 }
 
+static void InitLines(void) {
+  for (int i = 0; i < 64; i++)
+    for (int j = 0; j < 8; j++) {
+      const int dx = KING_VECTORS[2 * j], dy = KING_VECTORS[2 * j + 1];
+      uint64_t between = 0, line = 0;
+      for (int k = -7; k <= 7; k++)
+        if (OnBoard(Xcoord(i) + k * dx, Ycoord(i) + k * dy))
+          line |= Bit(8 * (Ycoord(i) + k * dy) + Xcoord(i) + k * dx);
+      for (int k = 1; k < 8; k++) {
+        const int x = Xcoord(i) + k * dx, y = Ycoord(i) + k * dy;
+        if (!OnBoard(x, y))
+          break;
+        BETWEEN[i][8 * y + x] = between;
+        LINE[i][8 * y + x]    = line;
+        between |= Bit(8 * y + x);
+      }
+    }
+}
+
 static void InitJumpMoves(void) {
   const int pawn_check_vectors[2 * 2] = {-1,1,1,1}, pawn_1_vectors[1 * 2] = {0,1};
   for (int i = 0; i < 64; i++) {
@@ -2057,6 +4200,11 @@ static void InitEvalStuff(void) {
       EVAL_PSQT_MG_B[i][Mirror(j)] = EVAL_PSQT_MG[i][j];
       EVAL_PSQT_EG_B[i][Mirror(j)] = EVAL_PSQT_EG[i][j];
     }
+  for (int i = 0; i < 6; i++)
+    for (int j = 0; j < 64; j++) {
+      EVAL_PIECE_SQ[6 + i + 1][j] = +PACK((i < 5 ? EVAL_PIECE_VALUE_MG[i] : 0) + EVAL_PSQT_MG[i][j],   (i < 5 ? EVAL_PIECE_VALUE_EG[i] : 0) + EVAL_PSQT_EG[i][j]);
+      EVAL_PIECE_SQ[6 - i - 1][j] = -PACK((i < 5 ? EVAL_PIECE_VALUE_MG[i] : 0) + EVAL_PSQT_MG_B[i][j], (i < 5 ? EVAL_PIECE_VALUE_EG[i] : 0) + EVAL_PSQT_EG_B[i][j]);
+    }
 }
 
 static void InitZobrist(void) {
@@ -2073,24 +4221,30 @@ static void InitZobrist(void) {
 
 static void InitScale() {
   for (int i = 0; i < 100; i++)
-    SCALE[i] = i < 30 ? 1.0f : 1.0f - ((float) (i - 30)) / 100.0f;
+    SCALE[i] = i < 30 ? 100 : 100 - (i - 30);
 }
 
 static void Init(void) {
-  RANDOM_SEED += (uint64_t) time(NULL);
+  RandomReset(RANDOM_SEED + (uint64_t) time(NULL));
   InitEvalStuff();
-  InitBishopMagics();
-  InitRookMagics();
+  InitSliderMagics();
   InitZobrist();
   InitSliderMoves();
+  InitLines();
   InitJumpMoves();
   InitScale();
+  HashResize(HASH_MB);
   Fen(STARTPOS);
 }
 
 // "Wisdom begins in wonder." -- Socrates
-int main(void) {
+int main(int argc, char **argv) {
+  const uint64_t start = NowUs();
   Init();
-  UciLoop();
+  if (argc >= 3 && !strcmp(argv[1], "epd"))
+    return Epd(argc, argv);
+  if (argc >= 3 && !strcmp(argv[1], "gensfen"))
+    return Gensfen(argc, argv);
+  UciLoop(NowUs() - start);
   return EXIT_SUCCESS;
 }